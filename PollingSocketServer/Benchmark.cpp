@@ -0,0 +1,301 @@
+#include "Benchmark.h"
+
+#include <windows.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "Message.h"
+#include "FrameParser.h"
+#include "SnakeBoard.h"
+#include "SnakeBot.h"
+#include "Log.h"
+
+#pragma warning(disable:4996) //4996: 'fopen': This function or variable may be unsafe. Consider using fopen_s instead.
+
+namespace
+{
+	const int kTargetFramesPerParser = 1000000;
+
+	// small enough that every sample frame arrives across several reads.
+	const int kIncrementalReadSize = 16;
+
+	const int kTargetBotDecisions = 200000;
+
+	struct BotBoard
+	{
+		const char* name;
+		int rows;
+		int columns;
+		int heads;
+		int wallPercent;
+	};
+
+	const BotBoard kBotBoards[] =
+	{
+		{ "classic",	20,		20,		4,	20 },
+		{ "arena",		512,	512,	64,	20 },
+		{ "arena-dense",512,	512,	64,	50 },
+	};
+
+	const char* kSampleFrames[] =
+	{
+		"{\"type\":\"echo\",\"seq\":1024,\"payload\":\"0123456789abcdef0123456789abcdef\"}",
+		"{\"type\":\"service_create\",\"name\":\"snakecycles\"}",
+		"{\"type\":\"snakecycles\",\"subtype\":\"dir\",\"dir\":2}",
+		"{\"type\":\"snakecycles\",\"subtype\":\"dir\",\"dir\":3}",
+		"{\"type\":\"tictactoe\",\"name\":\"player\"}",
+		"{\"type\":\"tictactoe\",\"row\":1,\"col\":2}",
+		"{\"type\":\"checker\",\"name\":\"red\"}",
+		"{\"type\":\"checker\",\"from\":40,\"to\":33}",
+		"{\"type\":\"service_create\",\"name\":\"snakecycles\",\"mode\":\"arena\",\"region\":\"eu\",\"rating\":1500,\"bots\":4}",
+		"{\"type\":\"snakecycles\",\"subtype\":\"dir\",\"dir\":1,\"step\":812,\"seq\":97}",
+		"{\"type\":\"snakecycles\",\"subtype\":\"checksum\",\"step\":812,\"checksum\":3735928559}",
+	};
+
+	double GetSeconds()
+	{
+		static LARGE_INTEGER frequency = { 0 };
+		if (frequency.QuadPart == 0)
+		{
+			QueryPerformanceFrequency(&frequency);
+		}
+
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return static_cast<double>(counter.QuadPart) / frequency.QuadPart;
+	}
+
+	bool LoadFrames(const char* path, std::vector<std::string>& frames)
+	{
+		FILE* file = fopen(path, "rb");
+		if (file == NULL)
+		{
+			return false;
+		}
+
+		std::string frame;
+		int c = 0;
+		while ((c = fgetc(file)) != EOF)
+		{
+			if (c == '\0' || c == '\n')
+			{
+				if (!frame.empty())
+				{
+					frames.push_back(frame);
+					frame.clear();
+				}
+			}
+			else if (c != '\r')
+			{
+				frame += static_cast<char>(c);
+			}
+		}
+
+		if (!frame.empty())
+		{
+			frames.push_back(frame);
+		}
+
+		fclose(file);
+		return true;
+	}
+
+	// reads what the services would read for the same frame.
+	int ReadFields(Message& message)
+	{
+		int sum = 0;
+		int value = 0;
+		std::string name;
+
+		if (message.IsType("service_create"))
+		{
+			message.GetString("name", name);
+			if (name == "snakecycles")
+			{
+				std::string field;
+				message.GetString("code", field);
+				sum += message.GetInt("room", value) ? value : 0;
+				message.GetString("region", field);
+				sum += message.GetInt("rating", value) ? value : 0;
+				message.GetString("mode", field);
+				sum += message.GetInt("bots", value) ? value : 0;
+				sum += static_cast<int>(field.size());
+			}
+		}
+		else if (message.IsType("tictactoe"))
+		{
+			if (!message.GetString("name", name))
+			{
+				sum += message.GetInt("row", value) ? value : 0;
+				sum += message.GetInt("col", value) ? value : 0;
+			}
+		}
+		else if (message.IsType("checker"))
+		{
+			if (!message.GetString("name", name))
+			{
+				sum += message.GetInt("from", value) ? value : 0;
+				sum += message.GetInt("to", value) ? value : 0;
+			}
+		}
+		else if (message.IsType("snakecycles"))
+		{
+			if (message.IsSubtype("dir"))
+			{
+				sum += message.GetInt("dir", value) ? value : 0;
+				sum += message.GetInt("step", value) ? value : 0;
+				sum += message.GetInt("seq", value) ? value : 0;
+			}
+			else if (message.IsSubtype("checksum"))
+			{
+				unsigned int checksum = 0;
+				sum += message.GetInt("step", value) ? value : 0;
+				sum += message.GetUint("checksum", checksum) ? static_cast<int>(checksum & 0xffff) : 0;
+			}
+		}
+
+		return sum + static_cast<int>(name.size());
+	}
+
+	// feeds the frame in small reads the way PollingSocket does in the incremental mode.
+	int ReadIncremental(FrameParser& parser, const std::string& frame)
+	{
+		const char* data = frame.c_str();
+		int size = static_cast<int>(frame.size()) + 1;
+		int sum = 0;
+
+		while (size > 0)
+		{
+			int consumed = parser.Feed(data, std::min(size, kIncrementalReadSize));
+			data += consumed;
+			size -= consumed;
+
+			if (parser.IsComplete())
+			{
+				Message message(parser.GetData(), parser.GetSize(), parser.GetMembers());
+				sum += ReadFields(message);
+				parser.Reset();
+			}
+		}
+		return sum;
+	}
+}
+
+
+void Benchmark::RunParser(const char* path)
+{
+	std::vector<std::string> frames;
+
+	if (path)
+	{
+		if (!LoadFrames(path, frames) || frames.empty())
+		{
+			ERROR_MSG("Benchmark::RunParser() - failed to load frames from [%s]", path);
+			return;
+		}
+	}
+	else
+	{
+		frames.assign(kSampleFrames, kSampleFrames + sizeof(kSampleFrames)/sizeof(kSampleFrames[0]));
+	}
+
+	size_t totalBytes = 0;
+	for (size_t i = 0 ; i < frames.size() ; ++i)
+	{
+		totalBytes += frames[i].size() + 1;
+	}
+
+	int rounds = std::max<int>(1, kTargetFramesPerParser / static_cast<int>(frames.size()));
+
+	LOG("Benchmark::RunParser() - %d frames, %d bytes, %d rounds. [%s]", frames.size(), totalBytes, rounds, path ? path : "samples");
+
+	for (int parser = 0 ; parser < Message::kParserCount ; ++parser)
+	{
+		int checksum = 0;
+		FrameParser frameParser;
+		double begin = GetSeconds();
+
+		for (int round = 0 ; round < rounds ; ++round)
+		{
+			for (size_t i = 0 ; i < frames.size() ; ++i)
+			{
+				if (parser == Message::kParserIncremental)
+				{
+					checksum += ReadIncremental(frameParser, frames[i]);
+				}
+				else
+				{
+					Message message(frames[i].c_str(), static_cast<int>(frames[i].size()) + 1, static_cast<Message::Parser>(parser));
+					checksum += ReadFields(message);
+				}
+			}
+		}
+
+		double elapsed = GetSeconds() - begin;
+		double count = static_cast<double>(rounds) * frames.size();
+
+		LOG("Benchmark::RunParser() - %-11s : %8.1f ns/frame, %8.1f MB/s, checksum[%d]",
+			Message::GetParserName(static_cast<Message::Parser>(parser)),
+			elapsed * 1e9 / count,
+			static_cast<double>(totalBytes) * rounds / elapsed / (1024.0 * 1024.0),
+			checksum);
+	}
+}
+
+
+void Benchmark::RunSnakeBots()
+{
+	for (size_t b = 0 ; b < sizeof(kBotBoards)/sizeof(kBotBoards[0]) ; ++b)
+	{
+		const BotBoard& config = kBotBoards[b];
+
+		// fixed seed, so the runs are comparable.
+		srand(1);
+
+		SnakeBoard board;
+		board.Resize(config.rows, config.columns);
+		for (int y = 0 ; y < config.rows ; ++y)
+		{
+			for (int x = 0 ; x < config.columns ; ++x)
+			{
+				if (rand() % 100 < config.wallPercent)
+				{
+					board.Occupy(x, y, static_cast<SnakeBoard::Owner>(rand() % config.heads));
+				}
+			}
+		}
+
+		std::vector<SnakeBot::Head> heads;
+		std::vector<int> dirs;
+		while (static_cast<int>(heads.size()) < config.heads)
+		{
+			SnakeBot::Head head = { rand() % config.columns, rand() % config.rows };
+			if (!board.IsBlocked(head.x, head.y))
+			{
+				heads.push_back(head);
+				dirs.push_back(rand() % 4);
+			}
+		}
+
+		SnakeBot bot;
+		int checksum = 0;
+		double begin = GetSeconds();
+
+		for (int i = 0 ; i < kTargetBotDecisions ; ++i)
+		{
+			size_t self = i % heads.size();
+			checksum += bot.Choose(board, heads[self].x, heads[self].y, dirs[self], heads, self);
+		}
+
+		double elapsed = GetSeconds() - begin;
+
+		LOG("Benchmark::RunSnakeBots() - %-11s : %8.1f ns/decision, %10.0f decisions/s, checksum[%d]",
+			config.name,
+			elapsed * 1e9 / kTargetBotDecisions,
+			kTargetBotDecisions / elapsed,
+			checksum);
+	}
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// Offline measurements run from the command line instead of the server loop.
+namespace Benchmark
+{
+	// Reads frames separated by '\0' or '\n' from path (built-in samples when NULL)
+	// and reports the cost of every inbound parser side by side.
+	void RunParser(const char* path);
+
+	// Times SnakeBot decisions on classic and arena boards filled with random walls
+	// and heads, and reports the cost of one decision and how many a core can make.
+	void RunSnakeBots();
+};
@@ -3,10 +3,9 @@
 #include <algorithm>
 
 #include "Server.h"
+#include "Message.h"
 #include "Log.h"
 
-#include <rapidjson/writer.h>
-#include <rapidjson/stringbuffer.h>
 #include <boost/bind.hpp>
 
 #include <algorithm>
@@ -224,7 +223,11 @@ namespace Checker
 
 using namespace Checker;
 
-/*static*/ CheckerService::ServiceList CheckerService::sServices;
+/*static*/ Matchmaking::OpenSeats<CheckerService> CheckerService::sOpenSeats;
+/*static*/ Matchmaking::JoinCodes<CheckerService> CheckerService::sJoinCodes;
+/*static*/ Matchmaking::RoomListing CheckerService::sListing(CheckerService::GetMessageType());
+/*static*/ CheckerService::ServicePool CheckerService::sServices;
+/*static*/ RoomChecks<CheckerService> CheckerService::sChecks(&CheckerService::CheckRoom);
 
 /*static*/ void CheckerService::Init()
 {
@@ -235,100 +238,151 @@ using namespace Checker;
 {
 	LOG("CheckerService::Shutdown()");
 
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
-	{
-		delete sServices[i];
-	}
-	sServices.clear();
+	sServices.Clear();
+	sJoinCodes.Clear();
 }
 
 
-/*static*/ void CheckerService::Update()
+/*static*/ void CheckerService::OnRecv(PollingSocket* client, Message& message)
 {
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
+	sChecks.Enter();
+
+	if (!CreateOrEnter(client, message))
 	{
-		sServices[i]->UpdateInternal();
+		Session& session = client->GetSession();
+		if (session.IsBoundTo(Session::kServiceChecker))
+		{
+			CheckerService* service = static_cast<CheckerService*>(session.room);
+			service->OnRecvInternal(client, message);
+			sChecks.Push(service);
+		}
 	}
 
-	Flush();
+	sChecks.Leave();
 }
 
-/*static*/ void CheckerService::OnRecv(PollingSocket* client, rapidjson::Document& data)
+/*static*/ void CheckerService::RemoveClient(PollingSocket* client)
 {
-	if (CreateOrEnter(client, data))
+	Session& session = client->GetSession();
+	if (session.IsBoundTo(Session::kServiceChecker))
 	{
-		return;
-	}
-
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
-	{
-		sServices[i]->OnRecvInternal(client, data);
+		// also called from inside a handler of the room, when a send to the client fails.
+		CheckerService* service = static_cast<CheckerService*>(session.room);
+		service->RemoveClientInternal(client);
+		sChecks.Push(service);
+		sChecks.Flush();
 	}
 }
 
-/*static*/ void CheckerService::RemoveClient(PollingSocket* client)
+/*static*/ void CheckerService::Spectate(PollingSocket* client, Message& message)
 {
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
+	int roomId = 0;
+	message.GetInt("room", roomId);
+
+	CheckerService* service = sServices.Find(roomId);
+	if (service == NULL)
 	{
-		if (!sServices[i]->RemoveClientInternal(client))
-		{
-			return;
-		}
+		LOG("CheckerService::Spectate() - room[%d] is not found. ignored.", roomId);
+		return;
 	}
+
+	service->mChannel.Subscribe(client);
+	service->mChannel.MarkDirty();
 }
 
-/*static*/ bool CheckerService::CreateOrEnter(PollingSocket* client, rapidjson::Document& data)
+/*static*/ bool CheckerService::CreateOrEnter(PollingSocket* client, Message& message)
 {
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "service_create")
+	if (message.IsType("service_create"))
 	{
-		assert(data["name"].IsString());
-		std::string name(data["name"].GetString());
+		std::string name;
+		message.GetString("name", name);
 
 		if (name == "checker")
 		{
-			for (size_t i = 0 ; i < sServices.size() ; ++i)
+			Matchmaking::JoinRequest request = Matchmaking::ReadJoinRequest(message);
+
+			CheckerService* service = NULL;
+			if (!Matchmaking::Resolve(request, sOpenSeats, sJoinCodes, sServices, service))
 			{
-				CheckerService* service = sServices[i];
+				MessageWriter writer;
+				Matchmaking::WriteJoinFailed(writer, GetMessageType(), request);
+				client->AsyncSend(writer.GetData(), writer.GetSize());
+				return true;
+			}
+
+			if (service != NULL && client->GetSession().room == service)
+			{
+				// already playing there.
+				return true;
+			}
 
-				if (service->mFSM.GetState() == kStateWait && service->GetNumberOfPlayers() < 2)
+			// a connection plays in one room at a time. the one it is in is left only now that there is another.
+			Server::Instance()->LeaveRoom(client);
+
+			if (service == NULL)
+			{
+				service = sServices.Acquire();
+				service->mStats.Reset();
+				service->mBucket = request.bucket;
+				if (request.kind == Matchmaking::JoinRequest::kJoinNewPrivate)
 				{
-					service->AddClient(client);
-					return true;
+					sJoinCodes.Assign(*service);
 				}
+				service->OpenSeat();
 			}
 
-			CheckerService* newService = new CheckerService;
-			newService->AddClient(client);
-			sServices.push_back(newService);
+			service->AddClient(client);
+
+			if (Matchmaking::WriteJoined(service->mWriter, GetMessageType(), *service))
+			{
+				service->Send(client, service->mWriter);
+			}
 			return true;
 		}
 	}
 	return false;
 }
 
-/*static*/ void CheckerService::Flush()
+/*static*/ void CheckerService::ListRooms(PollingSocket* client, Message& message)
 {
-	for (auto itor = sServices.begin() ; itor != sServices.end() ; )
+	if (sListing.IsStale())
 	{
-		CheckerService* service = *itor;
+		sListing.Rebuild(sServices.GetActive());
+	}
 
-		if (service->mFSM.GetState() == kStateWait && service->GetNumberOfPlayers() == 0)
-		{
-			delete service;
-			itor = sServices.erase(itor);
-		}
-		else
-		{
-			++itor;
-		}
+	int page = 0;
+	message.GetInt("page", page);
+
+	const MessageWriter& writer = sListing.GetPage(page);
+	client->AsyncSend(writer.GetData(), writer.GetSize());
+}
+
+/*static*/ void CheckerService::CollectStats(RoomStatsReport::EntryList& entries)
+{
+	RoomStatsReport::Collect(GetMessageType(), sServices, entries);
+}
+
+/*static*/ void CheckerService::CheckRoom(CheckerService* service)
+{
+	// nothing in a room moves on time, so it is checked once each event is handled instead of every loop.
+	service->CheckPlayerConnection();
+
+	if (service->mFSM.GetState() == kStateWait && service->GetNumberOfPlayers() == 0)
+	{
+		sOpenSeats.Close(*service);
+		sJoinCodes.Reclaim(*service);
+		service->mChannel.Close();
+		sServices.Release(service);
 	}
 }
 
 CheckerService::CheckerService(void)
 	: m_Blocks(MAX_ROW*MAX_COL)
 {
+	mChannel.Init(boost::bind(&CheckerService::WriteSnapshot, this, _1),
+				  boost::bind(&CheckerService::WriteDelta, this, _1),
+				  &mStats);
+
 	InitFSM();
 }
 
@@ -361,23 +415,18 @@ void CheckerService::ShutdownFSM()
 }
 
 
-void CheckerService::UpdateInternal()
+void CheckerService::OnRecvInternal(PollingSocket* client, Message& message)
 {
-	CheckPlayerConnection();
+	RoomStats::Scope scope(mStats);
+	++mStats.messagesIn;
 
-	mFSM.Update();
-}
-
-
-void CheckerService::OnRecvInternal(PollingSocket* client, rapidjson::Document& data)
-{
 	switch(mFSM.GetState())
 	{
-	case kStateWait:			OnUpdateWait(client, data);			break;
-	case kStatePlayer1Turn:		OnUpdatePlayer1Turn(client, data);	break;
-	case kStatePlayer2Turn:		OnUpdatePlayer2Turn(client, data);	break;
-	case kStateCheckResult:		OnUpdateCheckResult(client, data);	break;
-	case kStateGameCanceled:	OnUpdateGameCanceled(client, data);	break;
+	case kStateWait:			OnUpdateWait(client, message);			break;
+	case kStatePlayer1Turn:		OnUpdatePlayer1Turn(client, message);	break;
+	case kStatePlayer2Turn:		OnUpdatePlayer2Turn(client, message);	break;
+	case kStateCheckResult:		OnUpdateCheckResult(client, message);	break;
+	case kStateGameCanceled:	OnUpdateGameCanceled(client, message);	break;
 
 	default:
 		assert(0);
@@ -393,10 +442,17 @@ void CheckerService::AddClient(PollingSocket* client)
 	if (mPlayer1.GetClient() == NULL)
 	{
 		mPlayer1.SetClient(client);
+		client->GetSession().Bind(Session::kServiceChecker, this, PLAYER_1);
 	}
 	else if (mPlayer2.GetClient() == NULL)
 	{
 		mPlayer2.SetClient(client);
+		client->GetSession().Bind(Session::kServiceChecker, this, PLAYER_2);
+	}
+
+	if (GetNumberOfPlayers() == MAX_PLAYER)
+	{
+		sOpenSeats.Close(*this);
 	}
 }
 
@@ -406,11 +462,15 @@ bool CheckerService::RemoveClientInternal(PollingSocket* client)
 	if (mPlayer1.GetClient() == client)
 	{
 		mPlayer1.SetClient(NULL);
+		client->GetSession().Clear();
+		OnSeatFreed();
 		return true;
 	}
 	else if (mPlayer2.GetClient() == client)
 	{
 		mPlayer2.SetClient(NULL);
+		client->GetSession().Clear();
+		OnSeatFreed();
 		return true;
 	}
 
@@ -418,6 +478,57 @@ bool CheckerService::RemoveClientInternal(PollingSocket* client)
 }
 
 
+void CheckerService::OnSeatFreed()
+{
+	if (mFSM.GetState() == kStateWait)
+	{
+		OpenSeat();
+	}
+}
+
+
+void CheckerService::ClearClients()
+{
+	if (mPlayer1.GetClient())
+	{
+		mPlayer1.GetClient()->GetSession().Clear();
+		mPlayer1.SetClient(NULL);
+	}
+	if (mPlayer2.GetClient())
+	{
+		mPlayer2.GetClient()->GetSession().Clear();
+		mPlayer2.SetClient(NULL);
+	}
+}
+
+
+void CheckerService::OpenSeat()
+{
+	// rooms waiting in the pool are not matched, private ones only by their code.
+	if (IsPoolActive() && !IsPrivate())
+	{
+		sOpenSeats.Open(*this, mBucket);
+	}
+}
+
+
+bool CheckerService::HasOpenSeat()
+{
+	return mFSM.GetState() == kStateWait && GetNumberOfPlayers() < MAX_PLAYER;
+}
+
+
+void CheckerService::WriteListEntry(MessageWriter& writer)
+{
+	writer.StartObject();
+	writer.Int("room", GetRoomId());
+	writer.Int("players", GetNumberOfPlayers());
+	writer.Int("max_players", MAX_PLAYER);
+	writer.String("bucket", mBucket.c_str());
+	writer.EndObject();
+}
+
+
 void CheckerService::CheckPlayerConnection()
 {
 	if (mFSM.GetState() == kStateWait)
@@ -437,29 +548,96 @@ void CheckerService::CheckPlayerConnection()
 }
 
 
-void CheckerService::Send(PollingSocket* client, rapidjson::Document& data)
+void CheckerService::Send(PollingSocket* client, const MessageWriter& writer)
 {
 	if (client)
 	{
-		client->AsyncSend(data);
+		client->AsyncSend(writer.GetData(), writer.GetSize());
+		mStats.OnSend(writer.GetSize());
 	}
 }
 
 
-void CheckerService::Broadcast(rapidjson::Document& data)
+void CheckerService::Broadcast(const MessageWriter& writer)
+{
+	Send(mPlayer1.GetClient(), writer);
+	Send(mPlayer2.GetClient(), writer);
+}
+
+
+void CheckerService::Publish(bool reset)
 {
-	Send(mPlayer1.GetClient(), data);
-	Send(mPlayer2.GetClient(), data);
+	if (reset)
+	{
+		mChannel.Reset();
+	}
+	else
+	{
+		mChannel.Touch();
+	}
+
+	// rooms still waiting in the pool have nobody watching.
+	if (IsPoolActive())
+	{
+		mChannel.MarkDirty();
+	}
 }
 
-void CheckerService::SetPlayerName(Player& player, rapidjson::Document& data)
+
+void CheckerService::WriteSnapshot(MessageWriter& writer)
 {
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "checker")
+	writer.Begin("checker", "snapshot");
+	WriteStatus(writer);
+
+	writer.StartArray("board");
+	for (size_t block = 0 ; block < m_Blocks.size() ; ++block)
 	{
-		assert(data["name"].IsString());
-		player.SetName(data["name"].GetString());
+		writer.Int(static_cast<int>(m_Blocks[block].GetColor()));
+	}
+	writer.EndArray();
+
+	writer.End();
+}
+
+
+void CheckerService::WriteDelta(MessageWriter& writer)
+{
+	writer.Begin("checker", "delta");
+	writer.Int("from_version", mChannel.GetDeltaFrom());
+	WriteStatus(writer);
+
+	writer.StartArray("moves");
+	for (size_t i = 0 ; i < mSpectatorMoves.size() ; ++i)
+	{
+		writer.Int(mSpectatorMoves[i]);
+	}
+	writer.EndArray();
+
+	writer.End();
+
+	mSpectatorMoves.clear();
+}
+
+
+void CheckerService::WriteStatus(MessageWriter& writer)
+{
+	writer.Int("room", GetRoomId());
+	writer.Int("version", mChannel.GetVersion());
+	writer.Int("state", mFSM.GetState());
+	writer.Int("turn", m_CurrentTurn);
+	writer.String("player1_name", mPlayer1.GetName().c_str());
+	writer.String("player2_name", mPlayer2.GetName().c_str());
+}
+
+void CheckerService::SetPlayerName(Player& player, Message& message)
+{
+	if (message.IsType("checker"))
+	{
+		std::string name;
+		if (message.GetString("name", name))
+		{
+			player.SetName(name.c_str());
+		}
 	}
 }
 
@@ -473,19 +651,28 @@ void CheckerService::OnEnterWait(int nPrevState)
 		m_Blocks[i].SetColor(Block::EMPTY);
 	}
 
+	// Init() drops the clients. release their sessions first.
+	ClearClients();
+
 	mPlayer1.Init(Block::WHITE, m_Blocks);
 	mPlayer2.Init(Block::RED, m_Blocks);
+
+	m_CurrentTurn = INVALID_PLAYER;
+	mSpectatorMoves.clear();
+	Publish(true);
+
+	OpenSeat();
 }
 
-void CheckerService::OnUpdateWait(PollingSocket* client, rapidjson::Document& data)
+void CheckerService::OnUpdateWait(PollingSocket* client, Message& message)
 {
 	if (mPlayer1.GetClient() == client)
 	{
-		SetPlayerName(mPlayer1, data);
+		SetPlayerName(mPlayer1, message);
 	}
 	else if (mPlayer2.GetClient() == client)
 	{
-		SetPlayerName(mPlayer2, data);
+		SetPlayerName(mPlayer2, message);
 	}
 	else
 	{
@@ -494,25 +681,26 @@ void CheckerService::OnUpdateWait(PollingSocket* client, rapidjson::Document& da
 
 	if (!mPlayer1.GetName().empty() && !mPlayer2.GetName().empty())
 	{
-		rapidjson::Document playerData;
-		playerData.SetObject();
-		playerData.AddMember("type", "checker", playerData.GetAllocator());
-		playerData.AddMember("subtype", "setplayers", playerData.GetAllocator());
-		playerData.AddMember("player1_name", mPlayer1.GetName().c_str(), playerData.GetAllocator());
-		playerData.AddMember("player2_name", mPlayer2.GetName().c_str(), playerData.GetAllocator());
-
-		rapidjson::Value board(rapidjson::kArrayType);
-		for (size_t i = 0 ; i < m_Blocks.size() ; ++i)
+		const Player* players[MAX_PLAYER] = { &mPlayer1, &mPlayer2 };
+		for (int i = PLAYER_1 ; i < MAX_PLAYER ; ++i)
 		{
-			board.PushBack(static_cast<int>(m_Blocks[i].GetColor()), playerData.GetAllocator());
-		}
-		playerData.AddMember("board", board, playerData.GetAllocator());
+			mWriter.Begin("checker", "setplayers");
+			mWriter.String("player1_name", mPlayer1.GetName().c_str());
+			mWriter.String("player2_name", mPlayer2.GetName().c_str());
+
+			mWriter.StartArray("board");
+			for (size_t block = 0 ; block < m_Blocks.size() ; ++block)
+			{
+				mWriter.Int(static_cast<int>(m_Blocks[block].GetColor()));
+			}
+			mWriter.EndArray();
 
-		playerData.AddMember("assigned_to", PLAYER_1, playerData.GetAllocator());
-		Send(mPlayer1.GetClient(), playerData);
+			mWriter.Int("assigned_to", i);
+			mWriter.Int("room", GetRoomId());
+			mWriter.End();
 
-		playerData["assigned_to"] = PLAYER_2;
-		Send(mPlayer2.GetClient(), playerData);
+			Send(players[i]->GetClient(), mWriter);
+		}
 
 		mFSM.SetState(kStatePlayer1Turn);
 	}
@@ -521,6 +709,8 @@ void CheckerService::OnUpdateWait(PollingSocket* client, rapidjson::Document& da
 void CheckerService::OnLeaveWait(int nNextState)
 {
 	LOG("CheckerService::OnLeaveWait()");
+
+	sOpenSeats.Close(*this);
 }
 
 
@@ -531,25 +721,25 @@ void CheckerService::SetPlayerTurn(int playerTurn)
 
 	m_CurrentTurn = playerTurn;
 
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "checker", data.GetAllocator());
-	data.AddMember("subtype", "setturn", data.GetAllocator());
-	data.AddMember("player", playerTurn, data.GetAllocator());
-	Broadcast(data);
+	mWriter.Begin("checker", "setturn");
+	mWriter.Int("player", playerTurn);
+	mWriter.End();
+	Broadcast(mWriter);
+
+	Publish(false);
 }
 
-void CheckerService::CheckPlayerMove(Player& player, rapidjson::Document& data)
+void CheckerService::CheckPlayerMove(Player& player, Message& message)
 {
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "checker")
+	if (message.IsType("checker"))
 	{
-		assert(data["from"].IsInt());
-		int from = data["from"].GetInt();
-
-		assert(data["to"].IsInt());
-		int to = data["to"].GetInt();
+		int from = -1;
+		int to = -1;
+		if (!message.GetInt("from", from) || !message.GetInt("to", to))
+		{
+			LOG("CheckerService::CheckPlayerMove() - from / to is missing. ignored.");
+			return;
+		}
 
 		int moveIndex = player.GetPossibleMove(from, to);
 		if (moveIndex >= 0)
@@ -559,15 +749,21 @@ void CheckerService::CheckPlayerMove(Player& player, rapidjson::Document& data)
 			mPlayer1.UpdatePossibleMoves(m_Blocks);
 			mPlayer2.UpdatePossibleMoves(m_Blocks);
 
-			rapidjson::Document data;
-			data.SetObject();
-			data.AddMember("type", "checker", data.GetAllocator());
-			data.AddMember("subtype", "move", data.GetAllocator());
-			data.AddMember("player", m_CurrentTurn, data.GetAllocator());
-			data.AddMember("from", m_LastMove.GetFrom(), data.GetAllocator());
-			data.AddMember("to", m_LastMove.GetTo(), data.GetAllocator());
-			data.AddMember("victim", m_LastMove.GetVictim(), data.GetAllocator());
-			Broadcast(data);
+			mWriter.Begin("checker", "move");
+			mWriter.Int("player", m_CurrentTurn);
+			mWriter.Int("from", m_LastMove.GetFrom());
+			mWriter.Int("to", m_LastMove.GetTo());
+			mWriter.Int("victim", m_LastMove.GetVictim());
+			mWriter.End();
+			Broadcast(mWriter);
+
+			if (mChannel.IsWatched())
+			{
+				mSpectatorMoves.push_back(m_LastMove.GetFrom());
+				mSpectatorMoves.push_back(m_LastMove.GetTo());
+				mSpectatorMoves.push_back(m_LastMove.GetVictim());
+			}
+			Publish(false);
 
 			mFSM.SetState(kStateCheckResult);
 		}
@@ -585,11 +781,11 @@ void CheckerService::OnEnterPlayer1Turn(int nPrevState)
 	SetPlayerTurn(PLAYER_1);
 }
 
-void CheckerService::OnUpdatePlayer1Turn(PollingSocket* client, rapidjson::Document& data)
+void CheckerService::OnUpdatePlayer1Turn(PollingSocket* client, Message& message)
 {
 	if (mPlayer1.GetClient() == client)
 	{
-		CheckPlayerMove(mPlayer1, data);
+		CheckPlayerMove(mPlayer1, message);
 	}
 	else
 	{
@@ -609,11 +805,11 @@ void CheckerService::OnEnterPlayer2Turn(int nPrevState)
 	SetPlayerTurn(PLAYER_2);
 }
 
-void CheckerService::OnUpdatePlayer2Turn(PollingSocket* client, rapidjson::Document& data)
+void CheckerService::OnUpdatePlayer2Turn(PollingSocket* client, Message& message)
 {
 	if (mPlayer2.GetClient() == client)
 	{
-		CheckPlayerMove(mPlayer2, data);
+		CheckPlayerMove(mPlayer2, message);
 	}
 	else
 	{
@@ -628,12 +824,10 @@ void CheckerService::OnLeavePlayer2Turn(int nNextState)
 
 void CheckerService::SetGameEnd(int winner)
 {
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "checker", data.GetAllocator());
-	data.AddMember("subtype", "result", data.GetAllocator());
-	data.AddMember("winner", winner, data.GetAllocator());
-	Broadcast(data);
+	mWriter.Begin("checker", "result");
+	mWriter.Int("winner", winner);
+	mWriter.End();
+	Broadcast(mWriter);
 
 	mFSM.SetState(kStateWait);
 }
@@ -719,7 +913,7 @@ void CheckerService::OnEnterCheckResult(int nPrevState)
 	}
 }
 
-void CheckerService::OnUpdateCheckResult(PollingSocket* client, rapidjson::Document& data) 
+void CheckerService::OnUpdateCheckResult(PollingSocket* client, Message& message) 
 {
 }
 
@@ -733,17 +927,15 @@ void CheckerService::OnEnterGameCanceled(int nPrevState)
 {
 	LOG("CheckerService::OnEnterGameCanceled()");
 
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "checker", data.GetAllocator());
-	data.AddMember("subtype", "canceled", data.GetAllocator());
-	Broadcast(data);
+	mWriter.Begin("checker", "canceled");
+	mWriter.End();
+	Broadcast(mWriter);
 
 	mFSM.SetState(kStateWait);
 }
 
 
-void CheckerService::OnUpdateGameCanceled(PollingSocket* client, rapidjson::Document& data)
+void CheckerService::OnUpdateGameCanceled(PollingSocket* client, Message& message)
 {
 }
 
@@ -2,11 +2,18 @@
 
 #include <vector>
 #include <string>
-#include <rapidjson/document.h>
 
 #include "FSM.h"
+#include "MessageWriter.h"
+#include "Session.h"
+#include "Matchmaking.h"
+#include "RoomPool.h"
+#include "RoomChecks.h"
+#include "RoomStats.h"
+#include "SpectatorChannel.h"
 
 class PollingSocket;
+class Message;
 
 namespace Checker
 {
@@ -92,25 +99,47 @@ namespace Checker
 	};
 }
 
-class CheckerService
+class CheckerService : public Matchmaking::OpenSeatHook, public Matchmaking::JoinCodeHook, public RoomPoolHook
 {
+public:
+	// ServicePack traits.
+	enum
+	{
+		kTicked = false,
+		kCreatesRooms = true,
+		kSession = Session::kServiceChecker,
+		kSpectated = true,
+	};
+	static const char* GetMessageType() { return "checker"; }
 
 public:
 	static void Init();
 	static void Shutdown();
 
-	static void Update();
-	static void OnRecv(PollingSocket* client, rapidjson::Document& data);
+	static void OnRecv(PollingSocket* client, Message& message);
 
 	static void RemoveClient(PollingSocket* client);
+	static void ListRooms(PollingSocket* client, Message& message);
+	static void CollectStats(RoomStatsReport::EntryList& entries);
+	const RoomStats& GetStats() const { return mStats; }
+
+	static void Spectate(PollingSocket* client, Message& message);
 
 private:
-	static bool CreateOrEnter(PollingSocket* client, rapidjson::Document& data);
-	static void Flush();
+	static bool CreateOrEnter(PollingSocket* client, Message& message);
+	static void CheckRoom(CheckerService* service);
 
 private:
-	typedef std::vector<CheckerService*> ServiceList;
-	static ServiceList sServices;
+	friend class RoomPool<CheckerService>;
+	friend class Matchmaking::RoomListing;
+	friend struct Matchmaking::JoinResolver<CheckerService>;
+
+	typedef RoomPool<CheckerService> ServicePool;
+	static Matchmaking::OpenSeats<CheckerService> sOpenSeats;
+	static Matchmaking::JoinCodes<CheckerService> sJoinCodes;
+	static Matchmaking::RoomListing sListing;
+	static ServicePool sServices;
+	static RoomChecks<CheckerService> sChecks;
 
 private:
 	enum State
@@ -138,50 +167,61 @@ private:
 	CheckerService(void);
 	~CheckerService(void);
 
-	void UpdateInternal();
-	void OnRecvInternal(PollingSocket* client, rapidjson::Document& data);
+	void OnRecvInternal(PollingSocket* client, Message& message);
 
 	void AddClient(PollingSocket* client);
 	bool RemoveClientInternal(PollingSocket* client);
+	void OnSeatFreed();
+	void ClearClients();
 
 	void InitFSM();
 	void ShutdownFSM();
 
 	void OnEnterWait(int nPrevState);
-	void OnUpdateWait(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdateWait(PollingSocket* client, Message& message);
 	void OnLeaveWait(int nNextState);
 
 	void OnEnterPlayer1Turn(int nPrevState);
-	void OnUpdatePlayer1Turn(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdatePlayer1Turn(PollingSocket* client, Message& message);
 	void OnLeavePlayer1Turn(int nNextState);
 
 	void OnEnterPlayer2Turn(int nPrevState);
-	void OnUpdatePlayer2Turn(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdatePlayer2Turn(PollingSocket* client, Message& message);
 	void OnLeavePlayer2Turn(int nNextState);
 
 	void OnEnterCheckResult(int nPrevState);
-	void OnUpdateCheckResult(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdateCheckResult(PollingSocket* client, Message& message);
 	void OnLeaveCheckResult(int nNextState);
 
 	void OnEnterGameCanceled(int nPrevState);
-	void OnUpdateGameCanceled(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdateGameCanceled(PollingSocket* client, Message& message);
 	void OnLeaveGameCanceled(int nNextState);
 
 	void DummyUpdate(double) {}
 
+	void OpenSeat();
+	bool HasOpenSeat();
+
+	bool IsListed() { return !IsPrivate() && HasOpenSeat(); }
+	void WriteListEntry(MessageWriter& writer);
 	void CheckPlayerConnection();
 
-	void SetPlayerName(Checker::Player& player, rapidjson::Document& data);
+	void SetPlayerName(Checker::Player& player, Message& message);
 	void SetPlayerTurn(int playerTurn);
-	void CheckPlayerMove(Checker::Player& player, rapidjson::Document& data);
+	void CheckPlayerMove(Checker::Player& player, Message& message);
 	int FindWinner() const;
 	int FindNextTurn();
 	void SetGameEnd(int winner);
 
 	int GetNumberOfPlayers() const;
 
-	void Send(PollingSocket* client, rapidjson::Document& data);
-	void Broadcast(rapidjson::Document& data);
+	void Send(PollingSocket* client, const MessageWriter& writer);
+	void Broadcast(const MessageWriter& writer);
+
+	void Publish(bool reset);
+	void WriteSnapshot(MessageWriter& writer);
+	void WriteDelta(MessageWriter& writer);
+	void WriteStatus(MessageWriter& writer);
 
 private:
 	FSM mFSM;
@@ -191,4 +231,14 @@ private:
 	std::vector<Checker::Block> m_Blocks;
 	int m_CurrentTurn;
 	Checker::Move m_LastMove;
+
+	MessageWriter mWriter;
+
+	// the matchmaking bucket the room was opened for.
+	std::string mBucket;
+
+	RoomStats mStats;
+
+	SpectatorChannel mChannel;
+	std::vector<int> mSpectatorMoves;	// from, to, victim since the last delta.
 };
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+// Lock-free queues between the I/O thread and the TaskPool workers.
+
+// Bounded ring for exactly one producer thread and one consumer thread.
+// The capacity is rounded up to a power of two. Push() fails when the ring is full.
+template <typename T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(size_t capacity)
+		: mHead(0)
+		, mTail(0)
+	{
+		size_t size = 1;
+		while (size < capacity)
+		{
+			size <<= 1;
+		}
+		mItems.resize(size);
+		mMask = size - 1;
+	}
+
+	// producer only.
+	bool Push(const T& item)
+	{
+		size_t tail = mTail.load(std::memory_order_relaxed);
+		if (tail - mHead.load(std::memory_order_acquire) == mItems.size())
+		{
+			return false;
+		}
+
+		mItems[tail & mMask] = item;
+		mTail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer only.
+	bool Pop(T& item)
+	{
+		size_t head = mHead.load(std::memory_order_relaxed);
+		if (head == mTail.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+
+		item = mItems[head & mMask];
+		mHead.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	SpscQueue(const SpscQueue&);
+	SpscQueue& operator=(const SpscQueue&);
+
+private:
+	std::vector<T> mItems;
+	size_t mMask;
+
+	// written by different threads. kept on separate cache lines.
+	char mPad0[64];
+	std::atomic<size_t> mHead;
+	char mPad1[64];
+	std::atomic<size_t> mTail;
+};
+
+
+// Unbounded intrusive queue for any number of producer threads and one consumer thread.
+// Nodes derive from MpscNode and belong to the consumer once popped.
+struct MpscNode
+{
+	MpscNode() : next(NULL) {}
+
+	std::atomic<MpscNode*> next;
+};
+
+class MpscQueue
+{
+public:
+	MpscQueue()
+		: mHead(&mStub)
+		, mTail(&mStub)
+	{
+	}
+
+	// any thread.
+	void Push(MpscNode* node)
+	{
+		node->next.store(NULL, std::memory_order_relaxed);
+		MpscNode* prev = mHead.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	// consumer only. returns NULL when empty or while a push is half way through.
+	MpscNode* Pop()
+	{
+		MpscNode* tail = mTail;
+		MpscNode* next = tail->next.load(std::memory_order_acquire);
+
+		if (tail == &mStub)
+		{
+			if (next == NULL)
+			{
+				return NULL;
+			}
+			mTail = next;
+			tail = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+
+		if (next)
+		{
+			mTail = next;
+			return tail;
+		}
+
+		if (tail != mHead.load(std::memory_order_acquire))
+		{
+			return NULL;
+		}
+
+		// tail is the last node. put the stub behind it to hand it out.
+		Push(&mStub);
+
+		next = tail->next.load(std::memory_order_acquire);
+		if (next)
+		{
+			mTail = next;
+			return tail;
+		}
+		return NULL;
+	}
+
+private:
+	MpscQueue(const MpscQueue&);
+	MpscQueue& operator=(const MpscQueue&);
+
+private:
+	MpscNode mStub;
+	std::atomic<MpscNode*> mHead;
+	MpscNode* mTail;
+};
@@ -1,12 +1,9 @@
 #include "EchoService.h"
 
-#include <string>
-
 #include "Server.h"
+#include "Message.h"
 #include "Log.h"
 
-#include <rapidjson/document.h>
-
 /*static*/ void EchoService::Init()
 {
 	LOG("EchoService::Init()");
@@ -17,12 +14,10 @@
 	LOG("EchoService::Shutdown()");
 }
 
-/*static*/ void EchoService::OnRecv(PollingSocket* client, rapidjson::Document& data)
+/*static*/ void EchoService::OnRecv(PollingSocket* client, Message& message)
 {
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "echo")
-	{
-		client->AsyncSend(data);
-	}
-}
+	assert(message.IsType("echo"));
+
+	// send the frame back as it arrived. no parsing, no re-serializing.
+	client->AsyncSend(message.GetData(), message.GetSize());
+}
\ No newline at end of file
@@ -1,13 +1,25 @@
 #pragma once
 
-#include <rapidjson\document.h>
+#include "Session.h"
 
 class PollingSocket;
+class Message;
 class EchoService
 {
+public:
+	// ServicePack traits.
+	enum
+	{
+		kTicked = false,
+		kCreatesRooms = false,
+		kSession = Session::kServiceNone,
+		kSpectated = false,
+	};
+	static const char* GetMessageType() { return "echo"; }
+
 public:
 	static void Init();
 	static void Shutdown();
 
-	static void OnRecv(PollingSocket* client, rapidjson::Document& data);
+	static void OnRecv(PollingSocket* client, Message& message);
 };
@@ -0,0 +1,187 @@
+#include "FrameParser.h"
+
+#include <cassert>
+#include <cstring>
+
+#include "Log.h"
+
+
+FrameParser::FrameParser()
+{
+	Reset();
+}
+
+
+void FrameParser::Reset()
+{
+	// keep the capacity for the next frame.
+	mBuffer.clear();
+	mMembers.clear();
+
+	mPhase = kPhaseBegin;
+	mDepth = 0;
+	mInString = false;
+	mEscape = false;
+	mKeyEscaped = false;
+
+	mFrameSize = 0;
+	mComplete = false;
+}
+
+
+int FrameParser::Feed(const char* data, int size)
+{
+	assert(!mComplete);
+
+	const char* terminator = static_cast<const char*>(memchr(data, '\0', size));
+	int length = terminator ? static_cast<int>(terminator - data) : size;
+
+	int consumed = terminator ? length + 1 : length;
+
+	if (mFrameSize + consumed <= kMaxFrameSize)
+	{
+		for (int i = 0 ; i < length ; ++i)
+		{
+			Lex(data[i], mFrameSize + i);
+		}
+		mBuffer.insert(mBuffer.end(), data, data + consumed);
+	}
+	else
+	{
+		// too large. only look for the end of it.
+		mPhase = kPhaseBroken;
+	}
+	mFrameSize += consumed;
+
+	if (terminator)
+	{
+		if (mFrameSize > kMaxFrameSize)
+		{
+			LOG("FrameParser::Feed() - frame too large [%d]. dropped.", mFrameSize);
+			Reset();
+		}
+		else
+		{
+			mComplete = true;
+		}
+	}
+
+	return consumed;
+}
+
+
+const Message::MemberList* FrameParser::GetMembers() const
+{
+	assert(mComplete);
+
+	// a broken frame is handed out without an index and fails the envelope scan.
+	return mPhase == kPhaseEnd ? &mMembers : NULL;
+}
+
+
+void FrameParser::Lex(char c, int offset)
+{
+	if (mInString)
+	{
+		if (mEscape)
+		{
+			mEscape = false;
+		}
+		else if (c == '\\')
+		{
+			mEscape = true;
+			mKeyEscaped = mKeyEscaped || (mPhase == kPhaseInKey);
+		}
+		else if (c == '"')
+		{
+			mInString = false;
+			if (mPhase == kPhaseInKey)
+			{
+				Message::Member& member = mMembers.back();
+				member.keyLength = mKeyEscaped ? -1 : offset - member.key;
+				mPhase = kPhaseColon;
+			}
+		}
+		return;
+	}
+
+	if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+	{
+		return;
+	}
+
+	switch (mPhase)
+	{
+	case kPhaseBegin:
+		mPhase = (c == '{') ? kPhaseKey : kPhaseBroken;
+		break;
+
+	case kPhaseKey:
+		if (c == '"')
+		{
+			Message::Member member;
+			member.key = offset + 1;
+			mMembers.push_back(member);
+
+			mInString = true;
+			mKeyEscaped = false;
+			mPhase = kPhaseInKey;
+		}
+		else
+		{
+			mPhase = (c == '}' && mMembers.empty()) ? kPhaseEnd : kPhaseBroken;
+		}
+		break;
+
+	case kPhaseColon:
+		mPhase = (c == ':') ? kPhaseValue : kPhaseBroken;
+		break;
+
+	case kPhaseValue:
+		mMembers.back().value = offset;
+		mPhase = kPhaseInValue;
+		// fall through. the first character belongs to the value.
+
+	case kPhaseInValue:
+		switch (c)
+		{
+		case '"':
+			mInString = true;
+			break;
+
+		case '{':
+		case '[':
+			++mDepth;
+			break;
+
+		case '}':
+		case ']':
+			if (mDepth > 0)
+			{
+				--mDepth;
+			}
+			else
+			{
+				mPhase = (c == '}') ? kPhaseEnd : kPhaseBroken;
+			}
+			break;
+
+		case ',':
+			if (mDepth == 0)
+			{
+				mPhase = kPhaseKey;
+			}
+			break;
+		}
+		break;
+
+	case kPhaseEnd:
+		// trailing garbage after the object.
+		mPhase = kPhaseBroken;
+		break;
+
+	case kPhaseInKey:
+	case kPhaseBroken:
+		break;
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+
+#include "Message.h"
+
+// Resumable parser for the incremental mode.
+// Bytes are consumed straight from recv() as they arrive. The lexer state is kept
+// between reads and the top-level members are indexed on the way, so a large frame
+// costs the same per read instead of a rescan and a full parse at its end.
+// Only the current frame is held. A frame larger than kMaxFrameSize is dropped
+// without being stored, so memory per connection stays bounded.
+class FrameParser
+{
+public:
+	enum
+	{
+		kMaxFrameSize = 64 * 1024,
+	};
+
+public:
+	FrameParser();
+
+	// returns the number of bytes consumed. stops right after a frame completes.
+	int Feed(const char* data, int size);
+
+	bool IsComplete() const { return mComplete; }
+	void Reset();
+
+	const char* GetData() const { return mBuffer.empty() ? NULL : &mBuffer[0]; }
+	int GetSize() const { return static_cast<int>(mBuffer.size()); }
+	const Message::MemberList* GetMembers() const;
+
+private:
+	void Lex(char c, int offset);
+
+private:
+	enum Phase
+	{
+		kPhaseBegin,
+		kPhaseKey,
+		kPhaseInKey,
+		kPhaseColon,
+		kPhaseValue,
+		kPhaseInValue,
+		kPhaseEnd,
+		kPhaseBroken,
+	};
+
+	std::vector<char> mBuffer;
+	Message::MemberList mMembers;
+
+	Phase mPhase;
+	int mDepth;
+	bool mInString;
+	bool mEscape;
+	bool mKeyEscaped;
+
+	int mFrameSize;
+	bool mComplete;
+};
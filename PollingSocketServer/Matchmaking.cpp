@@ -0,0 +1,147 @@
+#include "Matchmaking.h"
+
+#include <winsock2.h>
+#include <random>
+#include <algorithm>
+#include <cassert>
+
+#include "Message.h"
+
+namespace Matchmaking
+{
+	std::string GetBucket(Message& message)
+	{
+		std::string bucket;
+		message.GetString("region", bucket);
+		if (bucket.size() > kMaxRegionLength)
+		{
+			bucket.resize(kMaxRegionLength);
+		}
+
+		int rating = 0;
+		if (message.GetInt("rating", rating))
+		{
+			bucket += '#';
+			bucket += std::to_string(static_cast<long long>(rating >= 0 ? rating / kRatingBand : -1));
+		}
+
+		return bucket;
+	}
+
+	JoinRequest ReadJoinRequest(Message& message)
+	{
+		JoinRequest request;
+
+		if (message.GetString("code", request.code))
+		{
+			request.kind = JoinRequest::kJoinCode;
+		}
+		else if (message.GetInt("room", request.roomId))
+		{
+			request.kind = JoinRequest::kJoinRoom;
+		}
+		else if (message.IsSubtype("private"))
+		{
+			request.kind = JoinRequest::kJoinNewPrivate;
+		}
+		else
+		{
+			request.kind = JoinRequest::kJoinMatch;
+			request.bucket = GetBucket(message);
+		}
+
+		return request;
+	}
+
+	std::string MakeJoinCode()
+	{
+		// no 0/O or 1/I, the codes are read out loud.
+		static const char kAlphabet[] = "ABCDEFGHJKLMNPQRSTUVWXYZ23456789";
+		static std::random_device device;
+		static std::mt19937 engine(device());
+
+		std::uniform_int_distribution<int> pick(0, sizeof(kAlphabet) - 2);
+
+		std::string code(kJoinCodeLength, ' ');
+		for (int i = 0 ; i < kJoinCodeLength ; ++i)
+		{
+			code[i] = kAlphabet[pick(engine)];
+		}
+		return code;
+	}
+
+	void WritePrivateRoom(MessageWriter& writer, const char* service, int roomId, const std::string& code)
+	{
+		writer.Begin("service_create", "private");
+		writer.String("service", service);
+		writer.Int("room", roomId);
+		writer.String("code", code.c_str());
+		writer.End();
+	}
+
+	void WriteJoinFailed(MessageWriter& writer, const char* service, const JoinRequest& request)
+	{
+		writer.Begin("service_create", "notfound");
+		writer.String("service", service);
+		if (request.kind == JoinRequest::kJoinCode)
+		{
+			writer.String("code", request.code.c_str());
+		}
+		else
+		{
+			writer.Int("room", request.roomId);
+		}
+		writer.End();
+	}
+
+
+	RoomListing::RoomListing(const char* service)
+		: mService(service)
+		, mNumPages(0)
+		, mBuiltAt(0)
+		, mBuilt(false)
+	{
+	}
+
+	bool RoomListing::IsStale() const
+	{
+		return !mBuilt || GetTickCount() - mBuiltAt >= kListingTTL;
+	}
+
+	const MessageWriter& RoomListing::GetPage(int page) const
+	{
+		assert(mBuilt);
+		return mPages[std::min(std::max(page, 0), mNumPages - 1)];
+	}
+
+	void RoomListing::BeginRebuild(int count)
+	{
+		mNumPages = std::max((count + kPageSize - 1) / kPageSize, 1);
+		if (static_cast<int>(mPages.size()) < mNumPages)
+		{
+			mPages.resize(mNumPages);
+		}
+
+		mBuiltAt = GetTickCount();
+		mBuilt = true;
+
+		BeginPage(0);
+	}
+
+	void RoomListing::BeginPage(int page)
+	{
+		MessageWriter& writer = mPages[page];
+		writer.Begin("room_list");
+		writer.String("service", mService);
+		writer.Int("page", page);
+		writer.Int("pages", mNumPages);
+		writer.StartArray("rooms");
+	}
+
+	void RoomListing::EndPage(int page)
+	{
+		MessageWriter& writer = mPages[page];
+		writer.EndArray();
+		writer.End();
+	}
+}
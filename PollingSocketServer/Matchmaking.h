@@ -0,0 +1,297 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <boost/intrusive/list.hpp>
+
+#include "MessageWriter.h"
+#include "RoomPool.h"
+
+class Message;
+
+// Rooms with a free seat, so that a join takes one in O(1) instead of scanning every room.
+// A room links itself in while it accepts players and unlinks when it fills up or starts.
+// Rooms are bucketed by the optional "region" and "rating" of service_create and only
+// players of the same bucket are matched.
+//
+// Friends meet in a private room instead. It is addressed by a short join code, never
+// takes matched players and is left out of the public listing.
+//	{"type":"service_create", "name":"checker", "subtype":"private"}	: a new private room.
+//	{"type":"service_create", "name":"checker", "code":"K7QX2M"}		: the private room of the code.
+//	{"type":"service_create", "name":"checker", "room":12}				: a room from the listing.
+//	{"type":"room_list", "service":"checker", "page":0}					: a page of the rooms with a free seat.
+namespace Matchmaking
+{
+	enum
+	{
+		kRatingBand = 200,
+		kJoinCodeLength = 6,
+		kMaxRegionLength = 16,	// longer regions are cut. they come from clients.
+	};
+
+	// a room waiting in the open seats of a bucket.
+	class OpenSeatHook : public boost::intrusive::list_base_hook< boost::intrusive::link_mode<boost::intrusive::auto_unlink> >
+	{
+	public:
+		OpenSeatHook() : mOpenBucket(NULL) {}
+
+	private:
+		template <typename Room> friend class OpenSeats;
+
+		const std::string* mOpenBucket;		// the key of the bucket, while linked.
+	};
+
+	std::string GetBucket(Message& message);
+
+	// what a service_create asks for.
+	struct JoinRequest
+	{
+		enum Kind
+		{
+			kJoinMatch,			// the first open seat of the bucket, or a new room.
+			kJoinNewPrivate,
+			kJoinCode,
+			kJoinRoom,
+		};
+
+		JoinRequest() : kind(kJoinMatch), roomId(0) {}
+
+		Kind kind;
+		std::string bucket;
+		std::string code;
+		int roomId;
+	};
+
+	JoinRequest ReadJoinRequest(Message& message);
+	std::string MakeJoinCode();
+
+	// replies of a service_create. the creator of a private room learns its code from it.
+	void WritePrivateRoom(MessageWriter& writer, const char* service, int roomId, const std::string& code);
+	void WriteJoinFailed(MessageWriter& writer, const char* service, const JoinRequest& request);
+
+	// the join code of a private room. empty for a public one.
+	class JoinCodeHook
+	{
+	public:
+		bool IsPrivate() const { return !mJoinCode.empty(); }
+		const std::string& GetJoinCode() const { return mJoinCode; }
+
+	private:
+		template <typename Room> friend class JoinCodes;
+
+		std::string mJoinCode;
+	};
+
+	// join code -> private room. Room derives from JoinCodeHook.
+	template <typename Room>
+	class JoinCodes
+	{
+	public:
+		Room* Find(const std::string& code) const
+		{
+			typename CodeMap::const_iterator itor = mRooms.find(code);
+			return itor != mRooms.end() ? itor->second : NULL;
+		}
+
+		const std::string& Assign(Room& room)
+		{
+			std::string code = MakeJoinCode();
+			while (mRooms.find(code) != mRooms.end())
+			{
+				code = MakeJoinCode();
+			}
+
+			mRooms[code] = &room;
+			room.JoinCodeHook::mJoinCode.swap(code);
+			return room.JoinCodeHook::mJoinCode;
+		}
+
+		// the room goes back to the pool. its code can be handed out again.
+		void Reclaim(Room& room)
+		{
+			if (room.IsPrivate())
+			{
+				mRooms.erase(room.JoinCodeHook::mJoinCode);
+				room.JoinCodeHook::mJoinCode.clear();
+			}
+		}
+
+		void Clear() { mRooms.clear(); }
+
+	private:
+		typedef std::unordered_map<std::string, Room*> CodeMap;
+
+		CodeMap mRooms;
+	};
+
+	// The public rooms with a free seat, written into pages that are kept for kListingTTL.
+	// Lobby clients polling the listing are answered from the same bytes until it expires.
+	// Room provides IsListed() and WriteListEntry(MessageWriter&).
+	class RoomListing
+	{
+	public:
+		enum
+		{
+			kPageSize = 20,
+			kListingTTL = 1000,		// milliseconds
+		};
+
+	public:
+		explicit RoomListing(const char* service);
+
+		bool IsStale() const;
+		const MessageWriter& GetPage(int page) const;
+
+		template <typename Room>
+		void Rebuild(const std::vector<Room*>& rooms)
+		{
+			int count = 0;
+			for (size_t i = 0 ; i < rooms.size() ; ++i)
+			{
+				count += rooms[i]->IsListed() ? 1 : 0;
+			}
+
+			BeginRebuild(count);
+
+			int page = 0;
+			int inPage = 0;
+			for (size_t i = 0 ; i < rooms.size() ; ++i)
+			{
+				if (rooms[i]->IsListed())
+				{
+					if (inPage == kPageSize)
+					{
+						EndPage(page);
+						BeginPage(++page);
+						inPage = 0;
+					}
+
+					rooms[i]->WriteListEntry(mPages[page]);
+					++inPage;
+				}
+			}
+
+			EndPage(page);
+		}
+
+	private:
+		void BeginRebuild(int count);
+		void BeginPage(int page);
+		void EndPage(int page);
+
+	private:
+		const char* mService;
+		std::vector<MessageWriter> mPages;	// kept across rebuilds so the buffers are reused.
+		int mNumPages;
+		unsigned int mBuiltAt;
+		bool mBuilt;
+	};
+
+	// Room derives from OpenSeatHook. a destroyed room unlinks itself.
+	// buckets come from clients, so a bucket is kept only while a room waits in it.
+	template <typename Room>
+	class OpenSeats
+	{
+	public:
+		Room* Find(const std::string& bucket)
+		{
+			typename BucketMap::iterator itor = mBuckets.find(bucket);
+			if (itor == mBuckets.end())
+			{
+				return NULL;
+			}
+
+			if (itor->second.empty())
+			{
+				// the rooms of it were destroyed without a Close().
+				mBuckets.erase(itor);
+				return NULL;
+			}
+
+			return &itor->second.front();
+		}
+
+		void Open(Room& room, const std::string& bucket)
+		{
+			if (!room.OpenSeatHook::is_linked())
+			{
+				typename BucketMap::iterator itor = mBuckets.insert(typename BucketMap::value_type(bucket, RoomList())).first;
+				itor->second.push_back(room);
+				room.OpenSeatHook::mOpenBucket = &itor->first;
+			}
+		}
+
+		void Close(Room& room)
+		{
+			if (!room.OpenSeatHook::is_linked())
+			{
+				return;
+			}
+
+			room.OpenSeatHook::unlink();
+
+			typename BucketMap::iterator itor = mBuckets.find(*room.OpenSeatHook::mOpenBucket);
+			room.OpenSeatHook::mOpenBucket = NULL;
+			if (itor != mBuckets.end() && itor->second.empty())
+			{
+				mBuckets.erase(itor);
+			}
+		}
+
+	private:
+		typedef boost::intrusive::list< Room, boost::intrusive::constant_time_size<false> > RoomList;
+		typedef std::unordered_map<std::string, RoomList> BucketMap;
+
+		BucketMap mBuckets;
+	};
+
+	// the room a join request goes to, left in room. NULL when a new one is to be acquired.
+	// false when a code or a room from the listing is asked for and it is gone, full or
+	// private. the client is answered with WriteJoinFailed() then.
+	// Room befriends JoinResolver<Room> for HasOpenSeat().
+	template <typename Room>
+	struct JoinResolver
+	{
+		static bool Resolve(const JoinRequest& request, OpenSeats<Room>& openSeats, const JoinCodes<Room>& joinCodes, const RoomPool<Room>& pool, Room*& room)
+		{
+			room = NULL;
+			switch(request.kind)
+			{
+			case JoinRequest::kJoinMatch:		room = openSeats.Find(request.bucket);	break;
+			case JoinRequest::kJoinCode:		room = joinCodes.Find(request.code);	break;
+			case JoinRequest::kJoinRoom:		room = pool.Find(request.roomId);		break;
+			case JoinRequest::kJoinNewPrivate:	break;
+			}
+
+			if (request.kind == JoinRequest::kJoinCode || request.kind == JoinRequest::kJoinRoom)
+			{
+				// a listed room is joined only while it is still public and open.
+				if (room == NULL || !room->HasOpenSeat() || (request.kind == JoinRequest::kJoinRoom && room->IsPrivate()))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	template <typename Room>
+	bool Resolve(const JoinRequest& request, OpenSeats<Room>& openSeats, const JoinCodes<Room>& joinCodes, const RoomPool<Room>& pool, Room*& room)
+	{
+		return JoinResolver<Room>::Resolve(request, openSeats, joinCodes, pool, room);
+	}
+
+	// the reply to whoever joined room. false when there is none to send, for a public room.
+	template <typename Room>
+	bool WriteJoined(MessageWriter& writer, const char* service, const Room& room)
+	{
+		if (!room.IsPrivate())
+		{
+			return false;
+		}
+
+		WritePrivateRoom(writer, service, room.GetRoomId(), room.GetJoinCode());
+		return true;
+	}
+}
@@ -0,0 +1,707 @@
+#include "Message.h"
+
+#include <cassert>
+#include <climits>
+#include <cstring>
+
+#include "Log.h"
+
+namespace
+{
+	const char* kParserNames[Message::kParserCount] = { "dom", "ondemand", "incremental" };
+
+	const char* SkipSpace(const char* cur, const char* end)
+	{
+		while (cur != end && (*cur == ' ' || *cur == '\t' || *cur == '\r' || *cur == '\n'))
+		{
+			++cur;
+		}
+		return cur;
+	}
+
+	// cur points to the opening quote. returns the position after the closing quote or NULL.
+	const char* SkipString(const char* cur, const char* end, bool& escaped)
+	{
+		assert(*cur == '"');
+
+		escaped = false;
+		for (++cur ; cur != end && *cur != '\0' ; ++cur)
+		{
+			if (*cur == '\\')
+			{
+				escaped = true;
+				if (++cur == end)
+				{
+					return NULL;
+				}
+			}
+			else if (*cur == '"')
+			{
+				return cur + 1;
+			}
+		}
+		return NULL;
+	}
+
+	// skips any value including nested objects and arrays. returns NULL on a broken frame.
+	const char* SkipValue(const char* cur, const char* end)
+	{
+		int depth = 0;
+		bool escaped = false;
+
+		while (cur != end && *cur != '\0')
+		{
+			switch (*cur)
+			{
+			case '"':
+				cur = SkipString(cur, end, escaped);
+				if (cur == NULL)
+				{
+					return NULL;
+				}
+				if (depth == 0)
+				{
+					return cur;
+				}
+				continue;
+
+			case '{':
+			case '[':
+				++depth;
+				break;
+
+			case '}':
+			case ']':
+				if (depth == 0)
+				{
+					// end of the enclosing object.
+					return cur;
+				}
+				if (--depth == 0)
+				{
+					return cur + 1;
+				}
+				break;
+
+			case ',':
+				if (depth == 0)
+				{
+					return cur;
+				}
+				break;
+			}
+			++cur;
+		}
+		return depth == 0 ? cur : NULL;
+	}
+
+	// returns the position of the first member or NULL if the frame is not an object.
+	const char* BeginObject(const char* cur, const char* end)
+	{
+		cur = SkipSpace(cur, end);
+		if (cur == end || *cur != '{')
+		{
+			return NULL;
+		}
+		return SkipSpace(cur + 1, end);
+	}
+
+	// reads '"key" :' and leaves cur on the value.
+	// returns false at the end of the object, with cur set to NULL if the frame is broken.
+	bool ReadKey(const char*& cur, const char* end, const char*& key, int& keyLength)
+	{
+		if (cur == end || *cur == '}')
+		{
+			return false;
+		}
+
+		if (*cur != '"')
+		{
+			cur = NULL;
+			return false;
+		}
+
+		bool escaped = false;
+		key = cur + 1;
+		cur = SkipString(cur, end, escaped);
+		if (cur == NULL)
+		{
+			return false;
+		}
+		// escaped keys never match the plain keys the services ask for.
+		keyLength = escaped ? -1 : static_cast<int>(cur - key) - 1;
+
+		cur = SkipSpace(cur, end);
+		if (cur == end || *cur != ':')
+		{
+			cur = NULL;
+			return false;
+		}
+
+		cur = SkipSpace(cur + 1, end);
+		if (cur == end)
+		{
+			cur = NULL;
+			return false;
+		}
+		return true;
+	}
+
+	// cur points right after a value. moves to the next key.
+	const char* NextMember(const char* cur, const char* end)
+	{
+		cur = SkipSpace(cur, end);
+		if (cur != end && *cur == ',')
+		{
+			cur = SkipSpace(cur + 1, end);
+		}
+		return cur;
+	}
+
+	bool KeyEquals(const char* key, int keyLength, const char* other)
+	{
+		return keyLength >= 0 && static_cast<int>(strlen(other)) == keyLength && memcmp(key, other, keyLength) == 0;
+	}
+
+	int HexValue(char c)
+	{
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	bool ReadHex4(const char*& cur, const char* end, unsigned int& codepoint)
+	{
+		if (end - cur < 4)
+		{
+			return false;
+		}
+
+		codepoint = 0;
+		for (int i = 0 ; i < 4 ; ++i, ++cur)
+		{
+			int digit = HexValue(*cur);
+			if (digit < 0)
+			{
+				return false;
+			}
+			codepoint = (codepoint << 4) | digit;
+		}
+		return true;
+	}
+
+	void AppendUTF8(std::string& out, unsigned int codepoint)
+	{
+		if (codepoint < 0x80)
+		{
+			out += static_cast<char>(codepoint);
+		}
+		else if (codepoint < 0x800)
+		{
+			out += static_cast<char>(0xC0 | (codepoint >> 6));
+			out += static_cast<char>(0x80 | (codepoint & 0x3F));
+		}
+		else if (codepoint < 0x10000)
+		{
+			out += static_cast<char>(0xE0 | (codepoint >> 12));
+			out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (codepoint & 0x3F));
+		}
+		else
+		{
+			out += static_cast<char>(0xF0 | (codepoint >> 18));
+			out += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+			out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+			out += static_cast<char>(0x80 | (codepoint & 0x3F));
+		}
+	}
+
+	// cur points to the opening quote.
+	bool DecodeString(const char* cur, const char* end, std::string& out)
+	{
+		assert(*cur == '"');
+
+		out.clear();
+		for (++cur ; cur != end && *cur != '\0' ; )
+		{
+			const char* run = cur;
+			while (cur != end && *cur != '"' && *cur != '\\' && *cur != '\0')
+			{
+				++cur;
+			}
+			out.append(run, cur);
+
+			if (cur == end || *cur == '\0')
+			{
+				return false;
+			}
+
+			if (*cur == '"')
+			{
+				return true;
+			}
+
+			// escape
+			if (++cur == end)
+			{
+				return false;
+			}
+
+			switch (*cur++)
+			{
+			case '"':	out += '"';		break;
+			case '\\':	out += '\\';	break;
+			case '/':	out += '/';		break;
+			case 'b':	out += '\b';	break;
+			case 'f':	out += '\f';	break;
+			case 'n':	out += '\n';	break;
+			case 'r':	out += '\r';	break;
+			case 't':	out += '\t';	break;
+
+			case 'u':
+				{
+					unsigned int codepoint = 0;
+					if (!ReadHex4(cur, end, codepoint))
+					{
+						return false;
+					}
+
+					if (codepoint >= 0xD800 && codepoint <= 0xDBFF)
+					{
+						// surrogate pair
+						unsigned int low = 0;
+						if (end - cur < 2 || cur[0] != '\\' || cur[1] != 'u')
+						{
+							return false;
+						}
+						cur += 2;
+						if (!ReadHex4(cur, end, low) || low < 0xDC00 || low > 0xDFFF)
+						{
+							return false;
+						}
+						codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+					}
+
+					AppendUTF8(out, codepoint);
+				}
+				break;
+
+			default:
+				return false;
+			}
+		}
+		return false;
+	}
+
+	// accepts integral numbers in [minValue, maxValue] only, the same as rapidjson's IsInt() / IsUint().
+	bool DecodeInteger(const char* cur, const char* end, long long minValue, long long maxValue, long long& value)
+	{
+		bool negative = false;
+		if (cur != end && *cur == '-')
+		{
+			negative = true;
+			++cur;
+		}
+
+		if (cur == end || *cur < '0' || *cur > '9')
+		{
+			return false;
+		}
+
+		long long limit = negative ? -minValue : maxValue;
+		long long result = 0;
+		for ( ; cur != end && *cur >= '0' && *cur <= '9' ; ++cur)
+		{
+			result = result * 10 + (*cur - '0');
+			if (result > limit)
+			{
+				return false;
+			}
+		}
+
+		if (cur != end && (*cur == '.' || *cur == 'e' || *cur == 'E'))
+		{
+			return false;
+		}
+
+		value = negative ? -result : result;
+		return true;
+	}
+
+	bool DecodeInt(const char* cur, const char* end, int& value)
+	{
+		long long result = 0;
+		if (!DecodeInteger(cur, end, INT_MIN, INT_MAX, result))
+		{
+			return false;
+		}
+
+		value = static_cast<int>(result);
+		return true;
+	}
+
+	bool DecodeUint(const char* cur, const char* end, unsigned int& value)
+	{
+		long long result = 0;
+		if (!DecodeInteger(cur, end, 0, UINT_MAX, result))
+		{
+			return false;
+		}
+
+		value = static_cast<unsigned int>(result);
+		return true;
+	}
+}
+
+
+/*static*/ Message::Parser Message::sParser = Message::kParserDOM;
+
+/*static*/ bool Message::SetParser(const char* name)
+{
+	for (int i = 0 ; i < kParserCount ; ++i)
+	{
+		if (strcmp(name, kParserNames[i]) == 0)
+		{
+			SetParser(static_cast<Parser>(i));
+			return true;
+		}
+	}
+	return false;
+}
+
+/*static*/ const char* Message::GetParserName(Parser parser)
+{
+	assert(parser >= 0 && parser < kParserCount);
+	return kParserNames[parser];
+}
+
+
+bool Message::Token::Equals(const char* other) const
+{
+	return str != NULL && KeyEquals(str, length, other);
+}
+
+
+Message::Message(const char* data, int size)
+	: mData(data)
+	, mSize(size)
+	, mParser(sParser)
+	, mMembers(NULL)
+	, mNumIndexed(-1)
+	, mParsed(false)
+{
+	Init();
+}
+
+
+Message::Message(const char* data, int size, Parser parser)
+	: mData(data)
+	, mSize(size)
+	, mParser(parser)
+	, mMembers(NULL)
+	, mNumIndexed(-1)
+	, mParsed(false)
+{
+	Init();
+}
+
+
+Message::Message(const char* data, int size, const MemberList* members)
+	: mData(data)
+	, mSize(size)
+	, mParser(kParserIncremental)
+	, mMembers(members)
+	, mNumIndexed(-1)
+	, mParsed(false)
+{
+	Init();
+}
+
+
+void Message::Init()
+{
+	assert(mData);
+
+	if (!ScanEnvelope())
+	{
+		LOG("Message::Init() - broken frame. %s", mData);
+		mType = Token();
+		mSubtype = Token();
+	}
+}
+
+
+bool Message::IsType(const char* type) const
+{
+	return mType.Equals(type);
+}
+
+
+bool Message::IsSubtype(const char* subtype) const
+{
+	return mSubtype.Equals(subtype);
+}
+
+
+bool Message::GetInt(const char* key, int& value)
+{
+	if (mParser == kParserDOM)
+	{
+		if (!ParseDocument() || !mDocument->HasMember(key))
+		{
+			return false;
+		}
+
+		const rapidjson::Value& member = (*mDocument)[key];
+		if (!member.IsInt())
+		{
+			return false;
+		}
+
+		value = member.GetInt();
+		return true;
+	}
+
+	const char* cur = FindValue(key);
+	return cur != NULL && DecodeInt(cur, mData + mSize, value);
+}
+
+
+bool Message::GetUint(const char* key, unsigned int& value)
+{
+	if (mParser == kParserDOM)
+	{
+		if (!ParseDocument() || !mDocument->HasMember(key))
+		{
+			return false;
+		}
+
+		const rapidjson::Value& member = (*mDocument)[key];
+		if (!member.IsUint())
+		{
+			return false;
+		}
+
+		value = member.GetUint();
+		return true;
+	}
+
+	const char* cur = FindValue(key);
+	return cur != NULL && DecodeUint(cur, mData + mSize, value);
+}
+
+
+bool Message::GetString(const char* key, std::string& value)
+{
+	if (mParser == kParserDOM)
+	{
+		if (!ParseDocument() || !mDocument->HasMember(key))
+		{
+			return false;
+		}
+
+		const rapidjson::Value& member = (*mDocument)[key];
+		if (!member.IsString())
+		{
+			return false;
+		}
+
+		value.assign(member.GetString(), member.GetStringLength());
+		return true;
+	}
+
+	const char* cur = FindValue(key);
+	if (cur == NULL || *cur != '"')
+	{
+		return false;
+	}
+
+	std::string decoded;
+	if (!DecodeString(cur, mData + mSize, decoded))
+	{
+		return false;
+	}
+
+	value.swap(decoded);
+	return true;
+}
+
+
+bool Message::ParseDocument()
+{
+	if (!mParsed)
+	{
+		mParsed = true;
+		mDocument.reset(new rapidjson::Document);
+		mDocument->Parse<0>(mData);
+
+		if (mDocument->HasParseError())
+		{
+			LOG("Message::ParseDocument() - parsing failed. %s error[%s]", mData, mDocument->GetParseError());
+		}
+	}
+
+	return !mDocument->HasParseError() && mDocument->IsObject();
+}
+
+
+// Walks the top-level members only, skipping nested values without building anything.
+bool Message::ScanEnvelope()
+{
+	if (mMembers)
+	{
+		const char* type = FindValue("type");
+		const char* subtype = FindValue("subtype");
+
+		return (type == NULL || ScanToken(type, mType, mTypeBuffer))
+			&& (subtype == NULL || ScanToken(subtype, mSubtype, mSubtypeBuffer));
+	}
+
+	const char* end = mData + mSize;
+	const char* cur = BeginObject(mData, end);
+	const char* key = NULL;
+	int keyLength = 0;
+
+	// the on-demand parser indexes the members on the way, so no read walks the frame again.
+	bool indexing = mParser == kParserOnDemand;
+	int numIndexed = 0;
+
+	while (cur && ReadKey(cur, end, key, keyLength))
+	{
+		if (indexing)
+		{
+			if (numIndexed < kMaxIndexedMembers)
+			{
+				Member& member = mIndex[numIndexed++];
+				member.key = static_cast<int>(key - mData);
+				member.keyLength = keyLength;
+				member.value = static_cast<int>(cur - mData);
+			}
+			else
+			{
+				indexing = false;
+			}
+		}
+
+		if (KeyEquals(key, keyLength, "type"))
+		{
+			if (!ScanToken(cur, mType, mTypeBuffer))
+			{
+				return false;
+			}
+		}
+		else if (KeyEquals(key, keyLength, "subtype"))
+		{
+			if (!ScanToken(cur, mSubtype, mSubtypeBuffer))
+			{
+				return false;
+			}
+		}
+		else
+		{
+			cur = SkipValue(cur, end);
+		}
+
+		if (cur)
+		{
+			cur = NextMember(cur, end);
+		}
+	}
+
+	if (cur == NULL || cur == end)
+	{
+		return false;
+	}
+
+	if (indexing)
+	{
+		mNumIndexed = numIndexed;
+	}
+	return true;
+}
+
+
+// points the token at the string value under cur. escaped values are decoded into buffer.
+bool Message::ScanToken(const char*& cur, Token& token, std::string& buffer)
+{
+	const char* end = mData + mSize;
+
+	if (*cur != '"')
+	{
+		// not a string. leave the token empty.
+		cur = SkipValue(cur, end);
+		return cur != NULL;
+	}
+
+	bool escaped = false;
+	const char* begin = cur;
+	cur = SkipString(cur, end, escaped);
+	if (cur == NULL)
+	{
+		return false;
+	}
+
+	if (escaped)
+	{
+		if (!DecodeString(begin, end, buffer))
+		{
+			return false;
+		}
+		token.str = buffer.c_str();
+		token.length = static_cast<int>(buffer.size());
+	}
+	else
+	{
+		token.str = begin + 1;
+		token.length = static_cast<int>(cur - token.str) - 1;
+	}
+	return true;
+}
+
+
+const char* Message::FindValue(const char* key) const
+{
+	if (mMembers)
+	{
+		return mMembers->empty() ? NULL : FindIndexed(&(*mMembers)[0], mMembers->size(), key);
+	}
+
+	if (mNumIndexed >= 0)
+	{
+		return FindIndexed(mIndex, mNumIndexed, key);
+	}
+
+	const char* end = mData + mSize;
+	const char* cur = BeginObject(mData, end);
+	const char* memberKey = NULL;
+	int keyLength = 0;
+
+	while (cur && ReadKey(cur, end, memberKey, keyLength))
+	{
+		if (KeyEquals(memberKey, keyLength, key))
+		{
+			return cur;
+		}
+
+		cur = SkipValue(cur, end);
+		if (cur)
+		{
+			cur = NextMember(cur, end);
+		}
+	}
+	return NULL;
+}
+
+
+const char* Message::FindIndexed(const Member* members, size_t count, const char* key) const
+{
+	for (size_t i = 0 ; i < count ; ++i)
+	{
+		if (KeyEquals(mData + members[i].key, members[i].keyLength, key))
+		{
+			return mData + members[i].value;
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+#include <rapidjson/document.h>
+
+// A single '\0' terminated frame received from a client.
+// Only the top-level "type" and "subtype" are scanned on construction so that
+// routing is cheap. Services read fields through GetInt() / GetUint() / GetString() without
+// knowing which parser serves them. The parser is selected once at startup.
+//	- kParserDOM		: rapidjson builds the whole document on the first read.
+//	- kParserOnDemand	: the envelope scan notes where each top-level member of the raw
+//						  frame starts, in a fixed array inside the Message. a read looks the key
+//						  up there and decodes only the value asked for. nothing is allocated.
+//	- kParserIncremental	: PollingSocket feeds a FrameParser as bytes arrive, which indexes
+//						  the top-level members. reads look the key up in that index.
+class Message
+{
+public:
+	enum Parser
+	{
+		kParserDOM = 0,
+		kParserOnDemand,
+		kParserIncremental,
+
+		kParserCount,
+	};
+
+	// offsets of a top-level member in the frame. keyLength is -1 for an escaped key.
+	struct Member
+	{
+		Member() : key(0), keyLength(-1), value(0) {}
+
+		int key;
+		int keyLength;
+		int value;
+	};
+	typedef std::vector<Member> MemberList;
+
+	static void SetParser(Parser parser) { sParser = parser; }
+	static bool SetParser(const char* name);
+	static Parser GetParser() { return sParser; }
+	static const char* GetParserName(Parser parser);
+
+public:
+	Message(const char* data, int size);
+	Message(const char* data, int size, Parser parser);
+	Message(const char* data, int size, const MemberList* members);
+
+	const char* GetData() const { return mData; }
+	int GetSize() const { return mSize; }
+
+	bool IsType(const char* type) const;
+	bool IsSubtype(const char* subtype) const;
+
+	bool GetInt(const char* key, int& value);
+	bool GetUint(const char* key, unsigned int& value);
+	bool GetString(const char* key, std::string& value);
+
+private:
+	struct Token
+	{
+		Token() : str(NULL), length(0) {}
+
+		bool Equals(const char* other) const;
+
+		const char* str;
+		int length;
+	};
+
+	void Init();
+	bool ScanEnvelope();
+	bool ScanToken(const char*& cur, Token& token, std::string& buffer);
+	const char* FindValue(const char* key) const;
+	const char* FindIndexed(const Member* members, size_t count, const char* key) const;
+
+	bool ParseDocument();
+
+private:
+	enum
+	{
+		kMaxIndexedMembers = 16,	// a wider frame is walked again on every read.
+	};
+
+	static Parser sParser;
+
+	const char* mData;
+	int mSize;
+	Parser mParser;
+	const MemberList* mMembers;
+
+	// the on-demand parser's own index. -1 when the frame is not indexed.
+	Member mIndex[kMaxIndexedMembers];
+	int mNumIndexed;
+
+	Token mType;
+	Token mSubtype;
+
+	// hold the decoded type / subtype when they were sent escaped.
+	std::string mTypeBuffer;
+	std::string mSubtypeBuffer;
+
+	bool mParsed;
+	boost::scoped_ptr<rapidjson::Document> mDocument;
+};
@@ -0,0 +1,121 @@
+#include "MessageWriter.h"
+
+#include <cassert>
+
+namespace
+{
+	const size_t kInitBufferSize = 256;
+	const char kHexDigits[] = "0123456789abcdef";
+}
+
+
+MessageWriter::MessageWriter()
+	: mNeedComma(false)
+{
+	mBuffer.reserve(kInitBufferSize);
+}
+
+
+void MessageWriter::End()
+{
+	EndObject();
+	Append('\0');
+}
+
+
+void MessageWriter::Int(int value)
+{
+	Separator();
+
+	char digits[16];
+	char* cur = digits + sizeof(digits);
+
+	// work on the unsigned value so that INT_MIN does not overflow.
+	unsigned int absValue = value < 0 ? 0u - static_cast<unsigned int>(value) : static_cast<unsigned int>(value);
+	do
+	{
+		*--cur = static_cast<char>('0' + absValue % 10);
+		absValue /= 10;
+	} while (absValue != 0);
+
+	if (value < 0)
+	{
+		*--cur = '-';
+	}
+
+	Append(cur, digits + sizeof(digits) - cur);
+	mNeedComma = true;
+}
+
+
+void MessageWriter::String(const char* value)
+{
+	assert(value);
+
+	Separator();
+	Append('"');
+
+	const char* run = value;
+	const char* cur = value;
+	for ( ; *cur != '\0' ; ++cur)
+	{
+		unsigned char c = static_cast<unsigned char>(*cur);
+		if (c >= 0x20 && c != '"' && c != '\\')
+		{
+			continue;
+		}
+
+		Append(run, cur - run);
+		run = cur + 1;
+
+		switch (c)
+		{
+		case '"':	Append("\\\"", 2);	break;
+		case '\\':	Append("\\\\", 2);	break;
+		case '\n':	Append("\\n", 2);	break;
+		case '\r':	Append("\\r", 2);	break;
+		case '\t':	Append("\\t", 2);	break;
+
+		default:
+			{
+				char escaped[6] = { '\\', 'u', '0', '0', kHexDigits[c >> 4], kHexDigits[c & 0xF] };
+				Append(escaped, sizeof(escaped));
+			}
+			break;
+		}
+	}
+
+	Append(run, cur - run);
+	Append('"');
+	mNeedComma = true;
+}
+
+
+void MessageWriter::StartObject()
+{
+	Separator();
+	Append('{');
+	mNeedComma = false;
+}
+
+
+void MessageWriter::EndObject()
+{
+	Append('}');
+	mNeedComma = true;
+}
+
+
+void MessageWriter::StartArray()
+{
+	Separator();
+	Append('[');
+	mNeedComma = false;
+}
+
+
+void MessageWriter::EndArray()
+{
+	Append(']');
+	mNeedComma = true;
+}
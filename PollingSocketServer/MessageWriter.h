@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Builds an outbound '\0' terminated JSON frame directly into a reusable buffer.
+// Keys and fixed strings are string literals copied with their compile-time length
+// and integers are formatted in place, so no DOM is built and nothing is allocated
+// once the buffer has grown to its working size.
+//
+//		writer.Begin("snakecycles", "countdown");
+//		writer.Int("number", 3);
+//		writer.End();
+//		client->AsyncSend(writer.GetData(), writer.GetSize());
+class MessageWriter
+{
+public:
+	MessageWriter();
+
+	template <size_t N>
+	void Begin(const char (&type)[N])
+	{
+		mBuffer.clear();
+		mNeedComma = false;
+
+		StartObject();
+		Literal("type", type);
+	}
+
+	template <size_t N, size_t M>
+	void Begin(const char (&type)[N], const char (&subtype)[M])
+	{
+		Begin(type);
+		Literal("subtype", subtype);
+	}
+
+	void End();
+
+	template <size_t N>
+	void Key(const char (&key)[N])
+	{
+		Separator();
+		Append('"');
+		Append(key, N-1);
+		Append("\":", 2);
+		mNeedComma = false;
+	}
+
+	template <size_t N, size_t M>
+	void Literal(const char (&key)[N], const char (&value)[M])
+	{
+		Key(key);
+		Append('"');
+		Append(value, M-1);
+		Append('"');
+		mNeedComma = true;
+	}
+
+	template <size_t N>
+	void Int(const char (&key)[N], int value) { Key(key); Int(value); }
+
+	template <size_t N>
+	void String(const char (&key)[N], const char* value) { Key(key); String(value); }
+
+	template <size_t N>
+	void StartArray(const char (&key)[N]) { Key(key); StartArray(); }
+
+	void Int(int value);
+	void String(const char* value);
+
+	void StartObject();
+	void EndObject();
+	void StartArray();
+	void EndArray();
+
+	const char* GetData() const { return mBuffer.empty() ? NULL : &mBuffer[0]; }
+	int GetSize() const { return static_cast<int>(mBuffer.size()); }
+
+private:
+	void Separator()
+	{
+		if (mNeedComma)
+		{
+			Append(',');
+		}
+	}
+
+	void Append(char c) { mBuffer.push_back(c); }
+	void Append(const char* str, size_t length) { mBuffer.insert(mBuffer.end(), str, str + length); }
+
+private:
+	std::vector<char> mBuffer;
+	bool mNeedComma;
+};
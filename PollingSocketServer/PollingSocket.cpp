@@ -6,6 +6,7 @@
 #include <rapidjson/stringbuffer.h>
 
 #include "Network.h"
+#include "Message.h"
 #include "Log.h"
 
 #pragma warning(disable:4996) //4996: 'std::copy': Function call with parameters that may be unsafe - this call relies on the caller to check that the passed values are correct. To disable this warning, use -D_SCL_SECURE_NO_WARNINGS. See documentation on how to use Visual C++ 'Checked Iterators'
@@ -13,6 +14,9 @@
 namespace
 {
 	const int kMaxDataSize = 1024;
+
+	const size_t kMaxFreeFrames = 64;
+	const size_t kMaxPooledFrameSize = 4096;	// a keyframe or a snapshot is not kept around.
 }
 
 PollingSocket::PollingSocket()
@@ -21,11 +25,21 @@ PollingSocket::PollingSocket()
 	, mRecvBuffer(kMaxDataSize)
 	, mSendBuffer(kMaxDataSize)
 {
+	mFreeFrames.reserve(kMaxFreeFrames);
 }
 
 
 PollingSocket::~PollingSocket()
 {
+	while (MpscNode* node = mPosted.Pop())
+	{
+		delete static_cast<PostedFrame*>(node);
+	}
+
+	for (size_t i = 0 ; i < mFreeFrames.size() ; ++i)
+	{
+		delete mFreeFrames[i];
+	}
 }
 
 
@@ -121,6 +135,7 @@ void PollingSocket::Shutdown(bool closeCallback)
 
 	mRecvBuffer.clear();
 	mSendBuffer.clear();
+	mFrameParser.Reset();
 
 	if (closeCallback)
 	{
@@ -276,6 +291,70 @@ void PollingSocket::AsyncSend(const rapidjson::Document& data)
 }
 
 
+void PollingSocket::PostSend(const char* jsonStr, int total)
+{
+	PostedFrame* frame = AcquireFrame();
+	frame->data.assign(jsonStr, jsonStr + total);
+	mPosted.Push(frame);
+}
+
+
+PollingSocket::PostedFrame* PollingSocket::AcquireFrame()
+{
+	{
+		std::lock_guard<std::mutex> lock(mFreeLock);
+		if (!mFreeFrames.empty())
+		{
+			PostedFrame* frame = mFreeFrames.back();
+			mFreeFrames.pop_back();
+			return frame;
+		}
+	}
+	return new PostedFrame;
+}
+
+
+void PollingSocket::FlushPosted()
+{
+	PostedFrame* sent[kMaxFreeFrames];
+	size_t numSent = 0;
+
+	while (MpscNode* node = mPosted.Pop())
+	{
+		PostedFrame* frame = static_cast<PostedFrame*>(node);
+		AsyncSend(&frame->data[0], static_cast<int>(frame->data.size()));
+
+		if (numSent == kMaxFreeFrames || frame->data.capacity() > kMaxPooledFrameSize)
+		{
+			delete frame;
+		}
+		else
+		{
+			sent[numSent++] = frame;
+		}
+	}
+
+	if (numSent == 0)
+	{
+		return;
+	}
+
+	// handed back under one lock.
+	std::lock_guard<std::mutex> lock(mFreeLock);
+	for (size_t i = 0 ; i < numSent ; ++i)
+	{
+		if (mFreeFrames.size() < kMaxFreeFrames)
+		{
+			mFreeFrames.push_back(sent[i]);
+		}
+		else
+		{
+			delete sent[i];
+		}
+	}
+}
+
+
 void PollingSocket::TrySend()
 {
 	if(mState != kStateConnected)
@@ -332,6 +411,18 @@ void PollingSocket::TryRecv()
 
 	while ( (result = recv(mSocket, temp, kMaxDataSize, 0)) > 0 )
 	{
+		if (Message::GetParser() == Message::kParserIncremental)
+		{
+			LOG("PollingSocket::OnReceive - received [%d].", result);
+
+			// parse as it comes. nothing piles up in mRecvBuffer.
+			if (!FeedParser(temp, result))
+			{
+				return;
+			}
+			continue;
+		}
+
 		int available = mRecvBuffer.capacity() - mRecvBuffer.size();
 		if (available < result)
 		{
@@ -343,7 +434,12 @@ void PollingSocket::TryRecv()
 
 		LOG("PollingSocket::OnReceive - received [%d].", result);
 
-		GenerateJSON();
+		GenerateMessage();
+
+		if (mState != kStateConnected)
+		{
+			return;
+		}
 	}
 
 	if (0 == result)
@@ -363,7 +459,7 @@ void PollingSocket::TryRecv()
 }
 
 
-void PollingSocket::GenerateJSON()
+void PollingSocket::GenerateMessage()
 {
 	RingBuffer::iterator itorEnd = std::find(mRecvBuffer.begin(), mRecvBuffer.end(), '\0');
 
@@ -371,28 +467,59 @@ void PollingSocket::GenerateJSON()
 	{
 		++itorEnd;
 
-		boost::array<char, kMaxDataSize> jsonStr;
+		int size = std::distance(mRecvBuffer.begin(), itorEnd);
 
-		assert(std::distance(mRecvBuffer.begin(), itorEnd) <= kMaxDataSize);
-		std::copy(mRecvBuffer.begin(), itorEnd, jsonStr.begin());
+		// hand out the ring buffer memory as it is unless the frame wraps around.
+		RingBuffer::array_range front = mRecvBuffer.array_one();
+		const char* frame = front.first;
+		if (front.second < static_cast<size_t>(size))
+		{
+			mFrameBuffer.assign(mRecvBuffer.begin(), itorEnd);
+			frame = &mFrameBuffer[0];
+		}
 
-		mRecvBuffer.erase(mRecvBuffer.begin(), itorEnd);
+		LOG("PollingSocket::GenerateMessage - received. %s", frame);
 
-		rapidjson::Document jsonData;
-		jsonData.Parse<0>(jsonStr.data());
+		// only the envelope is scanned here. the handler parses the rest if it wants the message.
+		Message message(frame, size);
+		mRecvCallback(this, message);
 
-		if (jsonData.HasParseError())
+		if (mState != kStateConnected)
 		{
-			LOG("PollingSocket::GenerateJSON - parsing failed. %s error[%s]", jsonStr.data(), jsonData.GetParseError());
-		}
-		else
-		{
-			LOG("PollingSocket::GenerateJSON - parsing succeeded. %s", jsonStr.data());
+			// closed by the handler.
+			return;
 		}
 
-		mRecvCallback(this, jsonData.HasParseError(), jsonData);
+		mRecvBuffer.erase_begin(size);
 
 		itorEnd = std::find(mRecvBuffer.begin(), mRecvBuffer.end(), '\0');
 	}
 }
 
+
+bool PollingSocket::FeedParser(const char* data, int size)
+{
+	while (size > 0)
+	{
+		int consumed = mFrameParser.Feed(data, size);
+		data += consumed;
+		size -= consumed;
+
+		if (mFrameParser.IsComplete())
+		{
+			LOG("PollingSocket::FeedParser - received. %s", mFrameParser.GetData());
+
+			Message message(mFrameParser.GetData(), mFrameParser.GetSize(), mFrameParser.GetMembers());
+			mRecvCallback(this, message);
+
+			if (mState != kStateConnected)
+			{
+				// closed by the handler.
+				return false;
+			}
+
+			mFrameParser.Reset();
+		}
+	}
+	return true;
+}
@@ -3,13 +3,19 @@
 #include <winsock2.h>
 #include <boost/function.hpp>
 #include <boost/circular_buffer.hpp>
+#include <vector>
+#include <mutex>
 #include <rapidjson/document.h>
 
+#include "FrameParser.h"
+#include "Session.h"
+#include "ConcurrentQueue.h"
+
 class PollingSocket
 {
 public:
 	typedef boost::function<void (PollingSocket*)> OnConnectFunc;
-	typedef boost::function<void (PollingSocket*, bool, rapidjson::Document& data)> OnRecvFunc;
+	typedef boost::function<void (PollingSocket*, Message& message)> OnRecvFunc;
 	typedef boost::function<void (PollingSocket*)> OnCloseFunc;
 	typedef boost::function<void (PollingSocket*)> OnAcceptFunc;
 
@@ -30,7 +36,14 @@ public:
 	void AsyncSend(const char* jsonStr, int total);
 	void AsyncSend(const rapidjson::Document& data);
 
+	// any thread. queued until the I/O thread calls FlushPosted().
+	void PostSend(const char* jsonStr, int total);
+	void FlushPosted();
+
 	SOCKET GetSocket() const { return mSocket; }
+	bool IsClosed() const { return mState == kStateClosed; }
+
+	Session& GetSession() { return mSession; }
 
 private:
 	bool CreateSocket(unsigned short port);
@@ -38,7 +51,8 @@ private:
 	void TrySend();
 	void TryRecv();
 
-	void GenerateJSON();
+	void GenerateMessage();
+	bool FeedParser(const char* data, int size);
 
 private:
 	SOCKET mSocket;
@@ -62,4 +76,24 @@ private:
 	typedef boost::circular_buffer<char> RingBuffer;
 	RingBuffer mRecvBuffer;
 	RingBuffer mSendBuffer;
+
+	std::vector<char> mFrameBuffer;
+
+	// used instead of mRecvBuffer in the incremental parser mode.
+	FrameParser mFrameParser;
+
+	Session mSession;
+
+	struct PostedFrame : public MpscNode
+	{
+		std::vector<char> data;
+	};
+	PostedFrame* AcquireFrame();
+
+	MpscQueue mPosted;
+
+	// sent frames come back here with their buffers, so a warm socket posts without allocating.
+	// a room's worker and the I/O thread may post to the same socket, hence the lock.
+	std::mutex mFreeLock;
+	std::vector<PostedFrame*> mFreeFrames;
 };
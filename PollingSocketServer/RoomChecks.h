@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+// The rooms of a service that only changes on events, waiting to be checked for disconnects
+// and released once no handler of the service is on the stack.
+// A send that fails inside a handler closes its client, and the client's RemoveClient()
+// runs right there. The room is queued then and checked after the outermost handler
+// returns, so nothing changes its state or releases it under a running handler.
+template <typename Room>
+class RoomChecks
+{
+public:
+	typedef void (*CheckFunc)(Room* room);
+
+public:
+	explicit RoomChecks(CheckFunc check) : mCheck(check), mDepth(0) {}
+
+	// around every handler. the rooms queued meanwhile are checked when the outermost one ends.
+	void Enter() { ++mDepth; }
+	void Leave()
+	{
+		assert(mDepth > 0);
+		--mDepth;
+		Flush();
+	}
+
+	void Push(Room* room)
+	{
+		if (std::find(mPending.begin(), mPending.end(), room) == mPending.end())
+		{
+			mPending.push_back(room);
+		}
+	}
+
+	void Flush()
+	{
+		if (mDepth > 0)
+		{
+			return;
+		}
+
+		// a check sends too. a room it queues again is still in the list and not checked twice.
+		++mDepth;
+		for (size_t i = 0 ; i < mPending.size() ; ++i)
+		{
+			mCheck(mPending[i]);
+		}
+		mPending.clear();
+		--mDepth;
+	}
+
+private:
+	RoomChecks(const RoomChecks&);
+	RoomChecks& operator=(const RoomChecks&);
+
+private:
+	CheckFunc mCheck;
+	int mDepth;
+	std::vector<Room*> mPending;
+};
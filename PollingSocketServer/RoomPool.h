@@ -0,0 +1,162 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cassert>
+
+template <typename Room> class RoomPool;
+
+// A room's position in its pool. -1 while the room waits in the free list.
+// The id is the room's slot in the pool and the count of its acquires, so a recycled room
+// gets a new one and the pool finds a room by id with an index and a compare.
+class RoomPoolHook
+{
+public:
+	RoomPoolHook() : mPoolIndex(-1), mRoomId(0), mSlot(0), mGeneration(0) {}
+
+	bool IsPoolActive() const { return mPoolIndex >= 0; }
+	int GetRoomId() const { return mRoomId; }
+
+private:
+	template <typename Room> friend class RoomPool;
+
+	int mPoolIndex;
+	int mRoomId;
+	int mSlot;
+	int mGeneration;
+};
+
+// Recycling storage for the rooms of a service.
+// Rooms are built kChunkSize at a time in contiguous chunks and never move, so sessions
+// and open-seat queues can point at them. A released room goes back to the free list
+// as it is, keeping its FSM and buffers, and is handed out again by Acquire().
+// The active rooms are kept dense and Release() is a swap-and-pop.
+// Room derives from RoomPoolHook and befriends RoomPool<Room> for its constructor.
+template <typename Room>
+class RoomPool
+{
+public:
+	enum
+	{
+		kChunkSize = 64,
+
+		// a room id is generation << kSlotBits | slot.
+		kSlotBits = 16,
+		kMaxRooms = 1 << kSlotBits,
+		kMaxGeneration = (1 << (31 - kSlotBits)) - 1,
+	};
+
+	typedef std::vector<Room*> RoomList;
+
+public:
+	RoomPool() {}
+	~RoomPool() { Clear(); }
+
+	Room* Acquire()
+	{
+		if (mFree.empty())
+		{
+			Grow();
+		}
+
+		Room* room = mFree.back();
+		mFree.pop_back();
+
+		Hook(room).mPoolIndex = static_cast<int>(mActive.size());
+		mActive.push_back(room);
+
+		// the generation starts at 1, so no id is 0.
+		RoomPoolHook& hook = Hook(room);
+		hook.mGeneration = hook.mGeneration < kMaxGeneration ? hook.mGeneration + 1 : 1;
+		hook.mRoomId = (hook.mGeneration << kSlotBits) | hook.mSlot;
+		return room;
+	}
+
+	void Release(Room* room)
+	{
+		// a room released twice would sit in the free list twice and go to two groups.
+		int index = Hook(room).mPoolIndex;
+		if (index < 0 || index >= static_cast<int>(mActive.size()) || mActive[index] != room)
+		{
+			assert(0);
+			return;
+		}
+
+		Room* last = mActive.back();
+		mActive[index] = last;
+		Hook(last).mPoolIndex = index;
+		mActive.pop_back();
+
+		Hook(room).mPoolIndex = -1;
+		mFree.push_back(room);
+	}
+
+	Room* Find(int roomId) const
+	{
+		if (roomId <= 0)
+		{
+			return NULL;
+		}
+
+		size_t slot = static_cast<size_t>(roomId & (kMaxRooms - 1));
+		if (slot >= mSlots.size())
+		{
+			return NULL;
+		}
+
+		// a released room keeps its id until it is acquired again.
+		Room* room = mSlots[slot];
+		return Hook(room).mPoolIndex >= 0 && Hook(room).mRoomId == roomId ? room : NULL;
+	}
+
+	const RoomList& GetActive() const { return mActive; }
+	size_t GetSize() const { return mActive.size(); }
+
+	void Clear()
+	{
+		for (size_t i = 0 ; i < mChunks.size() ; ++i)
+		{
+			delete [] mChunks[i];
+		}
+		mChunks.clear();
+		mActive.clear();
+		mFree.clear();
+		mSlots.clear();
+	}
+
+private:
+	RoomPool(const RoomPool&);
+	RoomPool& operator=(const RoomPool&);
+
+	static RoomPoolHook& Hook(Room* room) { return *room; }
+
+	void Grow()
+	{
+		Room* chunk = new Room[kChunkSize];
+		mChunks.push_back(chunk);
+
+		size_t capacity = mChunks.size() * kChunkSize;
+		assert(capacity <= static_cast<size_t>(kMaxRooms));
+		mActive.reserve(capacity);
+		mFree.reserve(capacity);
+		mSlots.reserve(capacity);
+
+		for (int i = 0 ; i < kChunkSize ; ++i)
+		{
+			Hook(&chunk[i]).mSlot = static_cast<int>(mSlots.size());
+			mSlots.push_back(&chunk[i]);
+		}
+
+		// lowest address first.
+		for (int i = kChunkSize - 1 ; i >= 0 ; --i)
+		{
+			mFree.push_back(&chunk[i]);
+		}
+	}
+
+private:
+	std::vector<Room*> mChunks;
+	RoomList mActive;
+	RoomList mFree;
+	RoomList mSlots;	// every room by its slot, for Find().
+};
@@ -0,0 +1,83 @@
+#include "RoomStats.h"
+
+#include <windows.h>
+#include <algorithm>
+
+#include "Log.h"
+
+namespace
+{
+	double sCyclesPerMicrosecond = 0;
+
+	const double kCalibrationSeconds = 0.02;
+
+	int ClampToInt(unsigned long long value)
+	{
+		return static_cast<int>(std::min<unsigned long long>(value, 0x7fffffff));
+	}
+
+	bool IsHotter(const RoomStatsReport::Entry& lhs, const RoomStatsReport::Entry& rhs)
+	{
+		return lhs.stats.cycles > rhs.stats.cycles;
+	}
+}
+
+/*static*/ void RoomStats::Calibrate()
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+
+	LARGE_INTEGER begin;
+	QueryPerformanceCounter(&begin);
+	unsigned long long beginCycles = __rdtsc();
+
+	LARGE_INTEGER now;
+	do
+	{
+		QueryPerformanceCounter(&now);
+	} while (now.QuadPart - begin.QuadPart < static_cast<LONGLONG>(frequency.QuadPart * kCalibrationSeconds));
+
+	unsigned long long cycles = __rdtsc() - beginCycles;
+	double microseconds = (now.QuadPart - begin.QuadPart) * 1e6 / frequency.QuadPart;
+	sCyclesPerMicrosecond = cycles / microseconds;
+
+	LOG("RoomStats::Calibrate() - %.1f cycles per microsecond", sCyclesPerMicrosecond);
+}
+
+/*static*/ double RoomStats::ToMicroseconds(unsigned long long cycles)
+{
+	return sCyclesPerMicrosecond > 0 ? cycles / sCyclesPerMicrosecond : 0;
+}
+
+
+namespace RoomStatsReport
+{
+	void Write(MessageWriter& writer, EntryList& entries, int top)
+	{
+		top = std::min(std::max(top, 1), static_cast<int>(kMaxTop));
+
+		size_t count = std::min(entries.size(), static_cast<size_t>(top));
+		std::partial_sort(entries.begin(), entries.begin() + count, entries.end(), IsHotter);
+
+		writer.Begin("room_stats");
+		writer.Int("total_rooms", static_cast<int>(entries.size()));
+
+		writer.StartArray("rooms");
+		for (size_t i = 0 ; i < count ; ++i)
+		{
+			const Entry& entry = entries[i];
+
+			writer.StartObject();
+			writer.String("service", entry.service);
+			writer.Int("room", entry.roomId);
+			writer.Int("cpu_us", ClampToInt(static_cast<unsigned long long>(RoomStats::ToMicroseconds(entry.stats.cycles))));
+			writer.Int("messages_in", static_cast<int>(entry.stats.messagesIn));
+			writer.Int("messages_out", static_cast<int>(entry.stats.messagesOut));
+			writer.Int("bytes_out", ClampToInt(entry.stats.bytesOut));
+			writer.EndObject();
+		}
+		writer.EndArray();
+
+		writer.End();
+	}
+}
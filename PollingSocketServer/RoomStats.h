@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <intrin.h>
+
+#include "MessageWriter.h"
+#include "RoomPool.h"
+
+// What a room has cost since it was acquired, to find the one slowing the loop down.
+// CPU time is counted in TSC cycles with a Scope around the room's handlers, which costs
+// two __rdtsc() and is converted to microseconds only when reported.
+// A room's stats are written by whichever thread runs the room, and read between ticks.
+struct RoomStats
+{
+	RoomStats() { Reset(); }
+
+	void Reset()
+	{
+		cycles = 0;
+		messagesIn = 0;
+		messagesOut = 0;
+		bytesOut = 0;
+	}
+
+	void OnSend(int size)
+	{
+		++messagesOut;
+		bytesOut += size;
+	}
+
+	class Scope
+	{
+	public:
+		explicit Scope(RoomStats& stats) : mStats(stats), mBegin(__rdtsc()) {}
+		~Scope() { mStats.cycles += __rdtsc() - mBegin; }
+
+	private:
+		Scope(const Scope&);
+		Scope& operator=(const Scope&);
+
+		RoomStats& mStats;
+		unsigned long long mBegin;
+	};
+
+	// measures the TSC against the performance counter once. call at startup.
+	static void Calibrate();
+	static double ToMicroseconds(unsigned long long cycles);
+
+	unsigned long long cycles;
+	unsigned int messagesIn;
+	unsigned int messagesOut;
+	unsigned long long bytesOut;
+};
+
+// The hottest rooms across the services, by CPU time.
+//	{"type":"room_stats", "top":10}
+namespace RoomStatsReport
+{
+	enum
+	{
+		kDefaultTop = 10,
+		kMaxTop = 100,
+	};
+
+	struct Entry
+	{
+		const char* service;
+		int roomId;
+		RoomStats stats;
+	};
+	typedef std::vector<Entry> EntryList;
+
+	// an entry for every active room of the pool. Room provides GetStats().
+	template <typename Room>
+	void Collect(const char* service, const RoomPool<Room>& pool, EntryList& entries)
+	{
+		const typename RoomPool<Room>::RoomList& rooms = pool.GetActive();
+		for (size_t i = 0 ; i < rooms.size() ; ++i)
+		{
+			Entry entry;
+			entry.service = service;
+			entry.roomId = rooms[i]->GetRoomId();
+			entry.stats = rooms[i]->GetStats();
+			entries.push_back(entry);
+		}
+	}
+
+	// keeps the top entries, hottest first, and writes them.
+	void Write(MessageWriter& writer, EntryList& entries, int top);
+}
@@ -1,13 +1,22 @@
 #include "Server.h"
+#include <algorithm>
 #include <boost/bind.hpp>
 
 #include "Network.h"
+#include "Message.h"
+#include "TaskPool.h"
+#include "SpectatorChannel.h"
 #include "Log.h"
 
 #include "EchoService.h"
 #include "TicTacToeService.h"
 #include "CheckerService.h"
 #include "SnakeCyclesService.h"
+#include "ServicePack.h"
+
+#include <boost/mpl/vector.hpp>
+
+typedef ServicePack< boost::mpl::vector<EchoService, TicTacToeService, CheckerService, SnakeCyclesService> > Services;
 
 Server::Server(void)
 {
@@ -23,10 +32,12 @@ bool Server::Init(unsigned short port)
 {
 	LOG("Server::Init() - port[%d]", port);
 
-	EchoService::Init();
-	TicTacToeService::Init();
-	CheckerService::Init();
-	SnakeCyclesService::Init();
+	TaskPool::Create();
+	TaskPool::Instance()->Init(0);
+
+	RoomStats::Calibrate();
+
+	Services::Init();
 
 	PollingSocket::OnAcceptFunc onAccept = boost::bind(&Server::OnAccept, this, _1);
 	PollingSocket::OnCloseFunc onClose = boost::bind(&Server::OnClose, this, _1);
@@ -41,17 +52,21 @@ void Server::Shutdown()
 
 	mListenSocket.Shutdown(false);
 
+	// no room may run while its clients go away.
+	TaskPool::Instance()->Shutdown();
+
 	for (size_t i = 0 ; i < mClientSockets.size() ; ++i)
 	{
-		mClientSockets[i]->Shutdown();
+		mClientSockets[i]->Shutdown(false);
 		delete mClientSockets[i];
 	}
 	mClientSockets.clear();
 
-	SnakeCyclesService::Shutdown();
-	CheckerService::Shutdown();
-	TicTacToeService::Shutdown();
-	EchoService::Shutdown();
+	DeleteClosedSockets();
+
+	Services::Shutdown();
+
+	TaskPool::Destroy();
 }
 
 
@@ -64,9 +79,26 @@ void Server::Update()
 		mClientSockets[i]->Poll();
 	}
 
-	TicTacToeService::Update();
-	CheckerService::Update();
-	SnakeCyclesService::Update();
+	// sent by the rooms running on the TaskPool.
+	for (size_t i = 0 ; i < mClientSockets.size() ; ++i)
+	{
+		mClientSockets[i]->FlushPosted();
+	}
+
+	// rooms on the I/O thread publish to their spectators here.
+	SpectatorChannel::FlushDirty();
+
+	// the rooms tick on the TaskPool while the sockets are polled. once the batch is done,
+	// the services catch up and start the next one.
+	if (TaskPool::Instance()->IsIdle())
+	{
+		SendRoomStats();
+
+		Services::Update();
+
+		// no room holds them anymore.
+		DeleteClosedSockets();
+	}
 }
 
 
@@ -83,7 +115,7 @@ void Server::OnAccept(PollingSocket* listenSocket)
 	}
 
 	PollingSocket* newClient = new PollingSocket;
-	PollingSocket::OnRecvFunc onRecv = boost::bind(&Server::OnRecv, this, _1, _2, _3);
+	PollingSocket::OnRecvFunc onRecv = boost::bind(&Server::OnRecv, this, _1, _2);
 	PollingSocket::OnCloseFunc onClose = boost::bind(&Server::OnClose, this, _1);
 
 	newClient->InitAccept(socket, onRecv, onClose);
@@ -97,12 +129,50 @@ void Server::OnAccept(PollingSocket* listenSocket)
 }
 
 
-void Server::OnRecv(PollingSocket* socket, bool parsingError, rapidjson::Document& data)
+void Server::OnRecv(PollingSocket* socket, Message& message)
 {
-	EchoService::OnRecv(socket, data);
-	TicTacToeService::OnRecv(socket, data);
-	CheckerService::OnRecv(socket, data);
-	SnakeCyclesService::OnRecv(socket, data);
+	// route on the envelope only. a service parses the message once it takes it.
+	if (message.IsType("service_create"))
+	{
+		// the service leaves the room the connection is in, once it has found it another.
+		Services::OnCreate(socket, message);
+	}
+	else if (message.IsType("room_list"))
+	{
+		std::string service;
+		message.GetString("service", service);
+
+		if (!Services::OnList(socket, message, service))
+		{
+			LOG("Server::OnRecv() - no room listing for service [%s]. ignored.", service.c_str());
+		}
+	}
+	else if (message.IsType("room_stats"))
+	{
+		StatsRequest request;
+		request.socket = socket;
+		request.top = RoomStatsReport::kDefaultTop;
+		message.GetInt("top", request.top);
+		mStatsRequests.push_back(request);
+	}
+	else if (message.IsType("spectate"))
+	{
+		// a connection watches one room at a time.
+		SpectatorChannel::Unsubscribe(socket);
+
+		std::string service;
+		if (!message.IsSubtype("leave") && message.GetString("service", service))
+		{
+			if (!Services::OnSpectate(socket, message, service))
+			{
+				LOG("Server::OnRecv() - no spectators for service [%s]. ignored.", service.c_str());
+			}
+		}
+	}
+	else if (!Services::OnRecv(socket, message))
+	{
+		LOG("Server::OnRecv() - no service for the message. ignored.");
+	}
 }
 
 
@@ -111,12 +181,54 @@ void Server::OnClose(PollingSocket* socket)
 	auto itor = std::find(mClientSockets.begin(), mClientSockets.end(), socket);
 	if (itor != mClientSockets.end())
 	{
-		TicTacToeService::RemoveClient(*itor);
-		CheckerService::RemoveClient(*itor);
-		SnakeCyclesService::RemoveClient(*itor);
+		LeaveRoom(socket);
+		SpectatorChannel::Unsubscribe(socket);
 
-		delete *itor;
+		mStatsRequests.erase(std::remove_if(mStatsRequests.begin(), mStatsRequests.end(),
+			[socket](const StatsRequest& request){ return request.socket == socket; }), mStatsRequests.end());
+
+		// a room on the TaskPool may still post to it. deleted between ticks.
+		mClosedSockets.push_back(socket);
 		mClientSockets.erase(itor);
 	}
 }
 
+
+void Server::DeleteClosedSockets()
+{
+	for (size_t i = 0 ; i < mClosedSockets.size() ; ++i)
+	{
+		delete mClosedSockets[i];
+	}
+	mClosedSockets.clear();
+}
+
+
+void Server::SendRoomStats()
+{
+	if (mStatsRequests.empty())
+	{
+		return;
+	}
+
+	mStatsEntries.clear();
+	Services::CollectStats(mStatsEntries);
+
+	MessageWriter writer;
+	for (size_t i = 0 ; i < mStatsRequests.size() ; ++i)
+	{
+		RoomStatsReport::Write(writer, mStatsEntries, mStatsRequests[i].top);
+		mStatsRequests[i].socket->AsyncSend(writer.GetData(), writer.GetSize());
+	}
+	mStatsRequests.clear();
+}
+
+
+void Server::LeaveRoom(PollingSocket* socket)
+{
+	// only the room the connection is bound to holds it.
+	Services::Leave(socket);
+
+	assert(socket->GetSession().service == Session::kServiceNone);
+}
+
@@ -2,8 +2,10 @@
 
 #include "TSingleton.h"
 #include "PollingSocket.h"
+#include "RoomStats.h"
 #include <vector>
-#include <rapidjson\document.h>
+
+class Message;
 
 class Server :  public TSingleton<Server>
 {
@@ -17,13 +19,29 @@ public:
 
 	void Update();
 
+	// takes the connection out of the room it is bound to, if any. the services call it once
+	// a service_create has found the connection another room.
+	void LeaveRoom(PollingSocket* socket);
+
 private:
 	void OnAccept(PollingSocket* listenSocket);
-	void OnRecv(PollingSocket* socket, bool parsingError, rapidjson::Document& data);
+	void OnRecv(PollingSocket* socket, Message& message);
 	void OnClose(PollingSocket* socket);
+	void DeleteClosedSockets();
+	void SendRoomStats();
 
 private:
 	PollingSocket mListenSocket;
 	std::vector<PollingSocket*> mClientSockets;	
+	std::vector<PollingSocket*> mClosedSockets;
+
+	// answered between ticks, when every room's stats hold still.
+	struct StatsRequest
+	{
+		PollingSocket* socket;
+		int top;
+	};
+	std::vector<StatsRequest> mStatsRequests;
+	RoomStatsReport::EntryList mStatsEntries;
 };
 
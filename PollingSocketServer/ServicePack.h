@@ -0,0 +1,168 @@
+#pragma once
+
+#include <boost/mpl/begin_end.hpp>
+#include <boost/mpl/deref.hpp>
+#include <boost/mpl/next.hpp>
+#include <string>
+
+#include "PollingSocket.h"
+#include "Message.h"
+#include "RoomStats.h"
+
+// The services the server runs, declared once as a type list and unrolled at compile time.
+//	typedef ServicePack< boost::mpl::vector<EchoService, TicTacToeService> > Services;
+//
+// Every service declares its traits :
+//	- kTicked		: Update() runs every loop. services without time-based work leave it out.
+//	- kCreatesRooms	: takes "service_create" and keeps clients in rooms. needs RemoveClient(), ListRooms()
+//					  and CollectStats().
+//	- kSession		: the Session::Service its rooms bind connections to.
+//	- kSpectated	: rooms take spectators through Spectate().
+//	- GetMessageType() : the message "type" routed to OnRecv().
+namespace ServicePackDetail
+{
+	template <typename Service, bool ticked>
+	struct Tick
+	{
+		static void Update() { Service::Update(); }
+	};
+
+	template <typename Service>
+	struct Tick<Service, false>
+	{
+		static void Update() {}
+	};
+
+	template <typename Service, bool createsRooms>
+	struct Rooms
+	{
+		static void OnCreate(PollingSocket* socket, Message& message) { Service::OnRecv(socket, message); }
+
+		static bool Leave(PollingSocket* socket)
+		{
+			if (socket->GetSession().IsBoundTo(static_cast<Session::Service>(Service::kSession)))
+			{
+				Service::RemoveClient(socket);
+				return true;
+			}
+			return false;
+		}
+
+		static void List(PollingSocket* socket, Message& message) { Service::ListRooms(socket, message); }
+		static void CollectStats(RoomStatsReport::EntryList& entries) { Service::CollectStats(entries); }
+	};
+
+	template <typename Service>
+	struct Rooms<Service, false>
+	{
+		static void OnCreate(PollingSocket*, Message&) {}
+		static bool Leave(PollingSocket*) { return false; }
+		static void List(PollingSocket*, Message&) {}
+		static void CollectStats(RoomStatsReport::EntryList&) {}
+	};
+
+	template <typename Service, bool spectated>
+	struct Spectators
+	{
+		static void Spectate(PollingSocket* socket, Message& message) { Service::Spectate(socket, message); }
+	};
+
+	template <typename Service>
+	struct Spectators<Service, false>
+	{
+		static void Spectate(PollingSocket*, Message&) {}
+	};
+
+	template <typename First, typename Last>
+	struct Unroll
+	{
+		typedef typename boost::mpl::deref<First>::type Service;
+		typedef Unroll<typename boost::mpl::next<First>::type, Last> Rest;
+
+		static void Init()
+		{
+			Service::Init();
+			Rest::Init();
+		}
+
+		// in the reverse order of Init().
+		static void Shutdown()
+		{
+			Rest::Shutdown();
+			Service::Shutdown();
+		}
+
+		static void Update()
+		{
+			Tick<Service, Service::kTicked != 0>::Update();
+			Rest::Update();
+		}
+
+		static bool OnRecv(PollingSocket* socket, Message& message)
+		{
+			if (message.IsType(Service::GetMessageType()))
+			{
+				Service::OnRecv(socket, message);
+				return true;
+			}
+			return Rest::OnRecv(socket, message);
+		}
+
+		static void OnCreate(PollingSocket* socket, Message& message)
+		{
+			Rooms<Service, Service::kCreatesRooms != 0>::OnCreate(socket, message);
+			Rest::OnCreate(socket, message);
+		}
+
+		static bool Leave(PollingSocket* socket)
+		{
+			return Rooms<Service, Service::kCreatesRooms != 0>::Leave(socket) || Rest::Leave(socket);
+		}
+
+		static bool OnSpectate(PollingSocket* socket, Message& message, const std::string& service)
+		{
+			if (Service::kSpectated && service == Service::GetMessageType())
+			{
+				Spectators<Service, Service::kSpectated != 0>::Spectate(socket, message);
+				return true;
+			}
+			return Rest::OnSpectate(socket, message, service);
+		}
+
+		static bool OnList(PollingSocket* socket, Message& message, const std::string& service)
+		{
+			if (Service::kCreatesRooms && service == Service::GetMessageType())
+			{
+				Rooms<Service, Service::kCreatesRooms != 0>::List(socket, message);
+				return true;
+			}
+			return Rest::OnList(socket, message, service);
+		}
+
+		static void CollectStats(RoomStatsReport::EntryList& entries)
+		{
+			Rooms<Service, Service::kCreatesRooms != 0>::CollectStats(entries);
+			Rest::CollectStats(entries);
+		}
+	};
+
+	template <typename Last>
+	struct Unroll<Last, Last>
+	{
+		static void Init() {}
+		static void Shutdown() {}
+		static void Update() {}
+		static bool OnRecv(PollingSocket*, Message&) { return false; }
+		static void OnCreate(PollingSocket*, Message&) {}
+		static bool Leave(PollingSocket*) { return false; }
+		static bool OnSpectate(PollingSocket*, Message&, const std::string&) { return false; }
+		static bool OnList(PollingSocket*, Message&, const std::string&) { return false; }
+		static void CollectStats(RoomStatsReport::EntryList&) {}
+	};
+}
+
+template <typename ServiceList>
+class ServicePack : public ServicePackDetail::Unroll<typename boost::mpl::begin<ServiceList>::type,
+													 typename boost::mpl::end<ServiceList>::type>
+{
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+
+class SpectatorChannel;
+
+// The room a connection currently plays in.
+// A service binds it when the connection enters one of its rooms and clears it when
+// the connection leaves, so a message goes straight to the owning room.
+struct Session
+{
+	enum Service
+	{
+		kServiceNone = 0,
+		kServiceTicTacToe,
+		kServiceChecker,
+		kServiceSnakeCycles,
+	};
+
+	Session() : service(kServiceNone), room(NULL), slot(-1), channel(NULL), channelSlot(-1) {}
+
+	void Bind(Service serviceBound, void* roomBound, int slotBound)
+	{
+		service = serviceBound;
+		room = roomBound;
+		slot = slotBound;
+	}
+
+	void Clear()
+	{
+		service = kServiceNone;
+		room = NULL;
+		slot = -1;
+	}
+
+	bool IsBoundTo(Service serviceBound) const { return service == serviceBound; }
+
+	void Unwatch()
+	{
+		channel = NULL;
+		channelSlot = -1;
+	}
+
+	Service service;
+	void* room;		// the service's room instance.
+	int slot;		// the seat in the room, if the service uses one.
+
+	// the room watched as a spectator. independent of the one played in.
+	SpectatorChannel* channel;
+	int channelSlot;	// -1 until the snapshot is sent.
+};
@@ -0,0 +1,44 @@
+#include "SnakeBoard.h"
+
+#include <cassert>
+#include <emmintrin.h>
+
+
+SnakeBoard::SnakeBoard()
+	: mRows(0)
+	, mColumns(0)
+	, mNumWords(0)
+{
+}
+
+
+void SnakeBoard::Resize(int rows, int columns)
+{
+	assert(rows > 0 && columns > 0);
+
+	mRows = rows;
+	mColumns = columns;
+
+	size_t numCells = static_cast<size_t>(rows) * columns;
+	mNumWords = (numCells + 63) / 64;
+
+	size_t numBlocks = (mNumWords + kWordsPerBlock - 1) / kWordsPerBlock;
+	mBits.resize(numBlocks * kWordsPerBlock);
+	mOwners.resize(numCells);
+
+	Reset();
+}
+
+
+void SnakeBoard::Reset()
+{
+	__m128i zero = _mm_setzero_si128();
+
+	__m128i* block = reinterpret_cast<__m128i*>(&mBits[0]);
+	__m128i* end = block + mBits.size() / kWordsPerBlock;
+
+	for ( ; block != end ; ++block)
+	{
+		_mm_storeu_si128(block, zero);
+	}
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// The walls of a SnakeCycles board, in two planes.
+//	- occupancy	: one bit per cell, row by row. collisions read only this, so even an arena
+//				  board is 32 KB and a classic one 64 bytes.
+//	- owners	: one byte per cell, the player whose wall it is. written with the bit and
+//				  read only for snapshots, where the bit says whether it is valid.
+// Reset() clears the bits 16 bytes at a time and leaves the owners as they are.
+class SnakeBoard
+{
+public:
+	typedef unsigned char Owner;
+
+public:
+	SnakeBoard();
+
+	// keeps the capacity, so a recycled room does not reallocate.
+	void Resize(int rows, int columns);
+	void Reset();
+
+	int GetRows() const { return mRows; }
+	int GetColumns() const { return mColumns; }
+
+	void Occupy(int x, int y, Owner owner)
+	{
+		int index = y * mColumns + x;
+		mBits[index >> 6] |= 1ULL << (index & 63);
+		mOwners[index] = owner;
+	}
+
+	bool IsOccupied(int x, int y) const
+	{
+		int index = y * mColumns + x;
+		return ((mBits[index >> 6] >> (index & 63)) & 1) != 0;
+	}
+
+	bool IsInside(int x, int y) const
+	{
+		return ((static_cast<unsigned int>(x) < static_cast<unsigned int>(mColumns))
+				& (static_cast<unsigned int>(y) < static_cast<unsigned int>(mRows))) != 0;
+	}
+
+	int GetIndex(int x, int y) const { return y * mColumns + x; }
+
+	// off the board or on a wall. no branch, so a random cell costs one load.
+	bool IsBlocked(int x, int y) const
+	{
+		unsigned int inside = static_cast<unsigned int>(IsInside(x, y));
+
+		// off the board reads cell 0 and is masked out.
+		int index = (y * mColumns + x) & -static_cast<int>(inside);
+		unsigned int occupied = static_cast<unsigned int>(mBits[index >> 6] >> (index & 63)) & 1;
+
+		return (occupied | (inside ^ 1)) != 0;
+	}
+
+	Owner GetOwner(int x, int y) const { return mOwners[y * mColumns + x]; }
+
+	// the occupancy in 64-cell words, for walking the walls without testing every cell.
+	size_t GetNumWords() const { return mNumWords; }
+	unsigned long long GetWord(size_t word) const { return mBits[word]; }
+	Owner GetOwnerAt(int index) const { return mOwners[index]; }
+
+private:
+	enum
+	{
+		kWordsPerBlock = 2,		// one SSE2 store.
+	};
+
+	int mRows;
+	int mColumns;
+	size_t mNumWords;
+
+	std::vector<unsigned long long> mBits;	// padded to whole 128-bit blocks.
+	std::vector<Owner> mOwners;
+};
@@ -0,0 +1,141 @@
+#include "SnakeBot.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "SnakeBoard.h"
+
+namespace
+{
+	const int kDirX[4] = { 0, 0, -1, 1 };
+	const int kDirY[4] = { 1, -1, 0, 0 };
+	const int kReverse[4] = { 1, 0, 3, 2 };
+
+	const int kScoreBlocked = -1000000;
+	const int kHeadOnPenalty = SnakeBot::kMaxVisited / 2;	// another head could take the same cell.
+
+	int Distance(int x0, int y0, int x1, int y1)
+	{
+		return abs(x0 - x1) + abs(y0 - y1);
+	}
+}
+
+
+SnakeBot::SnakeBot()
+	: mStamp(0)
+{
+	memset(mStamps, 0, sizeof(mStamps));
+}
+
+
+int SnakeBot::Choose(const SnakeBoard& board, int x, int y, int dir, const std::vector<Head>& heads, size_t self)
+{
+	// going on is kept unless a turn is strictly better. turning back runs into the wall just left.
+	int best = dir;
+	int bestScore = Evaluate(board, x + kDirX[dir], y + kDirY[dir], x, y, heads, self);
+
+	for (int turn = 0 ; turn < 4 ; ++turn)
+	{
+		if (turn == dir || turn == kReverse[dir])
+		{
+			continue;
+		}
+
+		int score = Evaluate(board, x + kDirX[turn], y + kDirY[turn], x, y, heads, self);
+		if (score > bestScore)
+		{
+			best = turn;
+			bestScore = score;
+		}
+	}
+	return best;
+}
+
+
+int SnakeBot::Evaluate(const SnakeBoard& board, int x, int y, int fromX, int fromY, const std::vector<Head>& heads, size_t self)
+{
+	if (board.IsBlocked(x, y))
+	{
+		return kScoreBlocked;
+	}
+
+	if (++mStamp == 0)
+	{
+		memset(mStamps, 0, sizeof(mStamps));
+		mStamp = 1;
+	}
+
+	// the cell left behind is a wall by the time this one is reached.
+	Visit(fromX - x, fromY - y);
+	Visit(0, 0);
+
+	int count = 0;
+	Node seed = { x, y, kOwnerSelf };
+	mQueue[count++] = seed;
+
+	int score = 0;
+	for (size_t i = 0 ; i < heads.size() ; ++i)
+	{
+		if (i == self)
+		{
+			continue;
+		}
+
+		const Head& head = heads[i];
+		int distance = Distance(head.x, head.y, x, y);
+		if (distance == 0)
+		{
+			// it is about to be a wall.
+			return kScoreBlocked;
+		}
+		if (distance == 1)
+		{
+			score -= kHeadOnPenalty;
+		}
+
+		if (distance <= kRadius && count < kMaxVisited && Visit(head.x - x, head.y - y))
+		{
+			Node other = { head.x, head.y, kOwnerOther };
+			mQueue[count++] = other;
+		}
+	}
+
+	// breadth first from every seed at once. a cell goes to whoever gets there first, the bot on a tie.
+	for (int next = 0 ; next < count ; ++next)
+	{
+		const Node node = mQueue[next];
+
+		for (int d = 0 ; d < 4 ; ++d)
+		{
+			int nx = node.x + kDirX[d];
+			int ny = node.y + kDirY[d];
+
+			if (Distance(nx, ny, x, y) > kRadius || board.IsBlocked(nx, ny) || !Visit(nx - x, ny - y))
+			{
+				continue;
+			}
+
+			if (count == kMaxVisited)
+			{
+				return score;
+			}
+
+			Node reached = { nx, ny, node.owner };
+			mQueue[count++] = reached;
+			score += node.owner == kOwnerSelf ? 1 : -1;
+		}
+	}
+	return score;
+}
+
+
+bool SnakeBot::Visit(int dx, int dy)
+{
+	unsigned int& stamp = mStamps[(dy + kRadius) * kWindow + (dx + kRadius)];
+	if (stamp == mStamp)
+	{
+		return false;
+	}
+	stamp = mStamp;
+	return true;
+}
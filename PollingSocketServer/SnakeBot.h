@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+class SnakeBoard;
+
+// Steers a SnakeCycles player with no client behind it.
+// Each free move is scored by a flood fill from the cell it leads to, raced against the
+// other heads nearby (a Voronoi split of the space around the bot): the cells the bot
+// reaches first count for it, the ones another head reaches first against it.
+// The fill stops after kMaxVisited cells and kRadius blocks, so a decision costs the same
+// on any board. the cells it has seen are stamped in a window around the move, so nothing
+// is allocated or cleared per decision either.
+// One SnakeBot is kept per room. it is not thread safe.
+class SnakeBot
+{
+public:
+	struct Head
+	{
+		int x;
+		int y;
+	};
+
+	enum
+	{
+		kMaxVisited = 256,
+		kRadius = 12,
+	};
+
+public:
+	SnakeBot();
+
+	// dir and the result are in SnakeCyclesService's order : up (y+1), down, left, right.
+	// heads are every player still moving, self among them.
+	int Choose(const SnakeBoard& board, int x, int y, int dir, const std::vector<Head>& heads, size_t self);
+
+private:
+	enum
+	{
+		kWindow = 2 * kRadius + 1,
+		kOwnerSelf = 0,
+		kOwnerOther,
+	};
+
+	struct Node
+	{
+		int x;
+		int y;
+		int owner;
+	};
+
+	int Evaluate(const SnakeBoard& board, int x, int y, int fromX, int fromY, const std::vector<Head>& heads, size_t self);
+
+	// cells seen by the fill, by their offset from the move. a new fill only bumps the stamp.
+	bool Visit(int dx, int dy);
+
+private:
+	unsigned int mStamp;
+	unsigned int mStamps[kWindow * kWindow];
+
+	Node mQueue[kMaxVisited];
+};
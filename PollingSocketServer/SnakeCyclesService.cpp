@@ -1,91 +1,130 @@
 #include "SnakeCyclesService.h"
 
+#include <windows.h>
 #include <algorithm>
+#include <sstream>
+#include <cstring>
 
 #include "Server.h"
+#include "Message.h"
+#include "TaskPool.h"
 #include "Log.h"
 
-#include <rapidjson/writer.h>
-#include <rapidjson/stringbuffer.h>
 #include <boost/bind.hpp>
 
 namespace
 {
 	const int kInitCountdown = 5;
-	const double kTimePerBlock = 1;
+
+	const unsigned int kSlotReportInterval = 10000;	// milliseconds
+
+	// a block in each Direction.
+	const int kStepX[4] = { 0, 0, -1, 1 };
+	const int kStepY[4] = { 1, -1, 0, 0 };
+
+	long long GetPerformanceCounter()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	long long GetPerformanceFrequency()
+	{
+		static LARGE_INTEGER frequency = { 0 };
+		if (frequency.QuadPart == 0)
+		{
+			QueryPerformanceFrequency(&frequency);
+		}
+		return frequency.QuadPart;
+	}
 }
 
 
-SnakeCyclesService::Player::Player(PollingSocket* client) 
+SnakeCyclesService::Player::Player(PollingSocket* client, bool bot) 
 	: mClient(client)
+	, mBot(bot)
 	, mName()
 	, mState(kStateDead) 
 	, mIndex(kPlayerNone)
-	, mTimeRemaing(kTimePerBlock)
+	, mTicksRemaining(0)
 	, mDirection(kDOWN)
 	, mPos()
+	, mFirstTurn(0)
+	, mNumTurns(0)
+	, mLastSeq(-1)
+	, mAckedFrame(0)
+	, mSentFrame(0)
+	, mResyncFrame(-1)
+	, mSlot(-1)
 {
 }
 
-void SnakeCyclesService::Player::Init(PlayerIndex index, PlayerIndex* board, int numRows, int numCols)
+void SnakeCyclesService::Player::Init(PlayerIndex index, int numPlayers, int numRows, int numCols)
 {
-	assert(board);
+	assert(index >= 0 && index < numPlayers);
 
 	mState = kStateAlive;
 	mIndex = index;	
-	mTimeRemaing = kTimePerBlock;
+	mTicksRemaining = sTicksPerBlock;
+
+	mFirstTurn = 0;
+	mNumTurns = 0;
+	mLastSeq = -1;
+
+	// the players go round the sides, top, right, bottom, left, and are spread evenly
+	// along each side facing in. up to four players start in the middle of the sides.
+	int perSide = (numPlayers + 3) / 4;
+	int along = index / 4;
 
-	switch(mIndex)
+	switch(index % 4)
 	{
-	case kPlayer1:
+	case 0:
 		// top
-		mPos.x = numCols/2;
+		mPos.x = (2*along + 1) * numCols / (2*perSide);
 		mPos.y = numRows-1;
 		mDirection = kDOWN;
 		break;
 
-	case kPlayer2:
+	case 1:
 		// right
 		mPos.x = numCols-1;
-		mPos.y = numRows/2;
+		mPos.y = (2*along + 1) * numRows / (2*perSide);
 		mDirection = kLEFT;
 		break;
 
-	case kPlayer3:
+	case 2:
 		// bottom
-		mPos.x = numCols/2;
+		mPos.x = (2*along + 1) * numCols / (2*perSide);
 		mPos.y = 0;
 		mDirection = kUP;
 		break;
 
-	case kPlayer4:
+	case 3:
 		// left
 		mPos.x = 0;
-		mPos.y = numRows/2;
+		mPos.y = (2*along + 1) * numRows / (2*perSide);
 		mDirection = kRIGHT;
 		break;
-
-	default:
-		assert(0);
-		return;
 	}
 }
 
-bool SnakeCyclesService::Player::Move(double elapsed, PlayerIndex* board, int numRows, int numCols, Wall& wall)
+bool SnakeCyclesService::Player::Move(SnakeBoard& board, Wall& wall)
 {
 	if (mState == kStateDead)
 	{
 		return false;
 	}
 
-	mTimeRemaing -= elapsed;
-	if (mTimeRemaing <= 0)
+	if (--mTicksRemaining <= 0)
 	{
-		mTimeRemaing = kTimePerBlock;
+		mTicksRemaining = sTicksPerBlock;
 
 		wall.pos = mPos;
 		wall.playerIndex = mIndex;
 
+		TakeTurn();
+
 		switch(mDirection)
 		{
 		case kUP:		mPos.y += 1;	break;
@@ -98,497 +137,1772 @@ bool SnakeCyclesService::Player::Move(double elapsed, PlayerIndex* board, int nu
 			return false;
 		}
 
-		int index = wall.pos.y * numCols + wall.pos.x;
-		board[index] = mIndex;
+		board.Occupy(wall.pos.x, wall.pos.y, static_cast<SnakeBoard::Owner>(mIndex));
 		return true;
 	}
 	return false;
 }
 
 
-void SnakeCyclesService::Player::CheckCollision(const std::vector<Player>& players, PlayerIndex* board, int numRows, int numCols)
+void SnakeCyclesService::Player::CheckCollision(const SnakeBoard& board, bool headOn)
 {
-	if (mPos.x < 0 || mPos.y < 0 || mPos.x >= numCols || mPos.y >= numRows)
-	{
-		mState = kStateDead;
-	}
-	else
-	{
-		int curIndex = mPos.y * numCols + mPos.x;
-		if (board[curIndex] != kPlayerNone)
-		{
-			mState = kStateDead;
-		}
-		else
-		{
-			for(size_t i = 0 ; i < players.size() ; ++i)
-			{
-				if (mIndex == players[i].mIndex)
-				{
-					continue;
-				}
+	// off the board, on a wall or on another head. all of it is folded in without branching.
+	int dead = static_cast<int>(board.IsBlocked(mPos.x, mPos.y)) | static_cast<int>(headOn);
 
-				if (mPos.x == players[i].mPos.x && mPos.y == players[i].mPos.y)
-				{
-					mState = kStateDead;
-					break;
-				}
-			}
-		}
-	}
+	mState = static_cast<State>(mState | dead);
 }
 
 
-void SnakeCyclesService::Player::GetStatus(rapidjson::Value& outData, rapidjson::Document::AllocatorType& allocator) const
+void SnakeCyclesService::Player::WriteStatus(MessageWriter& writer) const
 {
-	outData.SetObject();
-	outData.AddMember("index", static_cast<int>(mIndex), allocator);
-	outData.AddMember("x", mPos.x, allocator);
-	outData.AddMember("y", mPos.y, allocator);
-	outData.AddMember("dir", static_cast<int>(mDirection), allocator);
-	outData.AddMember("state", static_cast<int>(mState), allocator);
+	writer.StartObject();
+	writer.Int("index", static_cast<int>(mIndex));
+	writer.Int("x", mPos.x);
+	writer.Int("y", mPos.y);
+	writer.Int("dir", static_cast<int>(mDirection));
+	writer.Int("state", static_cast<int>(mState));
+	writer.EndObject();
 }
 
 
-/*static*/ SnakeCyclesService::ServiceList SnakeCyclesService::sServices;
-
-/*static*/ void SnakeCyclesService::Init()
+void SnakeCyclesService::Player::WriteChanges(MessageWriter& writer, const PlayerStatus& base) const
 {
-	LOG("SnakeCyclesService::Init()");
+	PlayerStatus status = GetStatus();
+
+	writer.StartObject();
+	writer.Int("index", static_cast<int>(mIndex));
+	if (status.x != base.x)			writer.Int("x", status.x);
+	if (status.y != base.y)			writer.Int("y", status.y);
+	if (status.dir != base.dir)		writer.Int("dir", status.dir);
+	if (status.state != base.state)	writer.Int("state", status.state);
+	writer.EndObject();
 }
 
-/*static*/ void SnakeCyclesService::Shutdown()
-{
-	LOG("SnakeCyclesService::Shutdown()");
 
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
-	{
-		delete sServices[i];
-	}
-	sServices.clear();
+SnakeCyclesService::PlayerStatus SnakeCyclesService::Player::GetStatus() const
+{
+	PlayerStatus status;
+	status.x = mPos.x;
+	status.y = mPos.y;
+	status.dir = static_cast<int>(mDirection);
+	status.state = static_cast<int>(mState);
+	return status;
 }
 
 
-/*static*/ void SnakeCyclesService::Update()
+bool SnakeCyclesService::Player::HasChanged(const PlayerStatus& base) const
 {
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
-	{
-		sServices[i]->UpdateInternal();
-	}
-
-	Flush();
+	return mPos.x != base.x || mPos.y != base.y || static_cast<int>(mDirection) != base.dir || static_cast<int>(mState) != base.state;
 }
 
-/*static*/ void SnakeCyclesService::OnRecv(PollingSocket* client, rapidjson::Document& data)
+
+void SnakeCyclesService::Player::MoveTo(SnakeBoard& board, Wall& wall, const Position& pos)
 {
-	CreateOrEnter(client, data);
+	// the engine took the next turn already, by the step it was given.
+	wall.pos = mPos;
+	wall.playerIndex = mIndex;
 
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
-	{
-		sServices[i]->OnRecvInternal(client, data);
-	}
+	TakeTurn();
+	mPos = pos;
+	mTicksRemaining = sTicksPerBlock;
+
+	board.Occupy(wall.pos.x, wall.pos.y, static_cast<SnakeBoard::Owner>(mIndex));
 }
 
-/*static*/ void SnakeCyclesService::RemoveClient(PollingSocket* client)
+
+void SnakeCyclesService::Player::TakeTurn()
 {
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
+	if (mNumTurns > 0)
 	{
-		if (!sServices[i]->RemoveClientInternal(client))
-		{
-			return;
-		}
+		mDirection = mTurns[mFirstTurn];
+		mFirstTurn = (mFirstTurn + 1) % kMaxQueuedTurns;
+		--mNumTurns;
 	}
 }
 
-/*static*/ void SnakeCyclesService::CreateOrEnter(PollingSocket* client, rapidjson::Document& data)
+
+bool SnakeCyclesService::Player::QueueTurn(Direction dir, int seq)
 {
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "service_create")
+	// the client numbers its directions. anything not newer than the last one is a repeat.
+	if (seq >= 0)
 	{
-		assert(data["name"].IsString());
-		std::string name(data["name"].GetString());
-
-		if (name == "snakecycles")
+		if (seq <= mLastSeq)
 		{
-			for (size_t i = 0 ; i < sServices.size() ; ++i)
-			{
-				SnakeCyclesService* service = sServices[i];
-
-				if (service->mFSM.GetState() == kStateWait || service->mFSM.GetState() == kStateCountdown)
-				{
-					if (service->mPlayers.size() < kMaxPlayers)
-					{
-						service->AddClient(client);
-						return;
-					}
-				}
-			}
-
-			SnakeCyclesService* newService = new SnakeCyclesService;
-			newService->AddClient(client);
-			sServices.push_back(newService);
+			return false;
 		}
+		mLastSeq = seq;
 	}
-}
 
-/*static*/ void SnakeCyclesService::Flush()
-{
-	for (auto itor = sServices.begin() ; itor != sServices.end() ; )
+	if (mNumTurns == kMaxQueuedTurns)
 	{
-		SnakeCyclesService* service = *itor;
-
-		if (service->mFSM.GetState() == kStateWait && service->mPlayers.empty())
-		{
-			delete service;
-			itor = sServices.erase(itor);
-		}
-		else
-		{
-			++itor;
-		}
+		return false;
 	}
+
+	mTurns[(mFirstTurn + mNumTurns) % kMaxQueuedTurns] = dir;
+	++mNumTurns;
+	return true;
 }
 
-SnakeCyclesService::SnakeCyclesService(void)
-	: mCoutdownRemaing(0)
-	, mCountdownSent(0)
-	, mWinner(kPlayerNone)
+
+void SnakeCyclesService::Player::Ack(int frame)
 {
-	InitFSM();
+	// an ack for a frame never sent is from another game, or made up.
+	if (frame > mAckedFrame && frame <= mSentFrame)
+	{
+		mAckedFrame = frame;
+	}
 }
 
 
-SnakeCyclesService::~SnakeCyclesService(void)
+/*static*/ const SnakeCyclesService::RoomConfig SnakeCyclesService::sRoomConfigs[] =
 {
-	ShutdownFSM();
-}
+	// mode			rows	columns	min	max	lockstep
+	{ "classic",	20,		20,		1,	4,	false },
+	{ "arena",		512,	512,	2,	64,	false },
+	{ "lockstep",	512,	512,	2,	64,	true },
+};
+
+/*static*/ Matchmaking::OpenSeats<SnakeCyclesService> SnakeCyclesService::sOpenSeats;
+/*static*/ Matchmaking::JoinCodes<SnakeCyclesService> SnakeCyclesService::sJoinCodes;
+/*static*/ Matchmaking::RoomListing SnakeCyclesService::sListing(SnakeCyclesService::GetMessageType());
+/*static*/ SnakeCyclesService::ServicePool SnakeCyclesService::sServices;
+/*static*/ std::vector<SnakeCyclesService::PendingJoin> SnakeCyclesService::sPendingJoins;
+/*static*/ std::vector<SnakeCyclesService::PendingLeave> SnakeCyclesService::sPendingLeaves;
+/*static*/ std::string SnakeCyclesService::sReplayDirectory;
+/*static*/ int SnakeCyclesService::sMaxReplays = 0;
+/*static*/ std::atomic<int> SnakeCyclesService::sReplayCount(0);
+/*static*/ bool SnakeCyclesService::sBatchMovement = false;
+/*static*/ std::vector<SnakeCyclesService::Shard> SnakeCyclesService::sShards;
+/*static*/ int SnakeCyclesService::sSlotRooms[SnakeCyclesService::kPhaseSlots];
+/*static*/ int SnakeCyclesService::sSlotWalls[SnakeCyclesService::kPhaseSlots];
+/*static*/ unsigned int SnakeCyclesService::sLastSlotReport = 0;
+/*static*/ int SnakeCyclesService::sTickRate = SnakeCyclesService::kDefaultTickRate;
+/*static*/ int SnakeCyclesService::sTicksPerBlock = SnakeCyclesService::kDefaultTicksPerBlock;
+/*static*/ unsigned int SnakeCyclesService::sTick = 0;
+/*static*/ long long SnakeCyclesService::sTickAccumulator = 0;
+/*static*/ long long SnakeCyclesService::sLastTickTime = 0;
 
-void SnakeCyclesService::InitFSM()
+/*static*/ void SnakeCyclesService::Init()
 {
-#define BIND_CALLBACKS(State) boost::bind(&SnakeCyclesService::OnEnter##State, this, _1), \
-							  boost::bind(&SnakeCyclesService::OnUpdate##State, this, _1), \
-							  boost::bind(&SnakeCyclesService::OnLeave##State, this, _1)
+	LOG("SnakeCyclesService::Init() - tick rate[%d] ticks per block[%d]", sTickRate, sTicksPerBlock);
 
-	mFSM.RegisterState(kStateWait, BIND_CALLBACKS(Wait));
-	mFSM.RegisterState(kStateCountdown, BIND_CALLBACKS(Countdown));
-	mFSM.RegisterState(kStatePlay, BIND_CALLBACKS(Play));
-	mFSM.RegisterState(kStateEnd, BIND_CALLBACKS(End));
+	sTick = 0;
+	sTickAccumulator = 0;
+	sLastTickTime = GetPerformanceCounter();
 
-#undef BIND_CALLBACKS
+	if (sBatchMovement)
+	{
+		// one task per worker, as many as there are to steal from each other.
+		sShards.resize(std::max(TaskPool::Instance()->GetNumThreads(), 1));
+		LOG("SnakeCyclesService::Init() - batch movement in %d shards", static_cast<int>(sShards.size()));
+	}
 
-	mFSM.SetState(kStateWait);
+	// answered before the first Update().
+	sListing.Rebuild(sServices.GetActive());
 }
 
-void SnakeCyclesService::ShutdownFSM()
+/*static*/ void SnakeCyclesService::Shutdown()
 {
-	mFSM.Reset(false);
-}
-
+	LOG("SnakeCyclesService::Shutdown()");
 
-void SnakeCyclesService::UpdateInternal()
-{
-	CheckPlayerConnection();
+	sServices.Clear();
+	sJoinCodes.Clear();
+	sPendingJoins.clear();
+	sPendingLeaves.clear();
+	sShards.clear();
 
-	mFSM.Update();
+	std::fill(sSlotRooms, sSlotRooms + kPhaseSlots, 0);
+	std::fill(sSlotWalls, sSlotWalls + kPhaseSlots, 0);
 }
 
 
-void SnakeCyclesService::OnRecvInternal(PollingSocket* client, rapidjson::Document& data)
+/*static*/ void SnakeCyclesService::Update()
 {
-	auto itor = std::find_if(mPlayers.begin(), mPlayers.end(), [client](const Player& player){ return player.GetClient() == client; } );
+	// the Server calls this only while the TaskPool is idle. no room is running, so the
+	// joins and leaves the I/O thread queued meanwhile are applied here.
+	ApplyLeaves();
 
-	if (itor == mPlayers.end())
-	{
-		return;
-	}
+	Flush();
 
-	switch(mFSM.GetState())
+	for (size_t i = 0 ; i < sPendingJoins.size() ; ++i)
 	{
-	case kStateWait:		OnRecvWait(*itor, data);		break;
-	case kStateCountdown:	OnRecvCountdown(*itor, data);	break;
-	case kStatePlay:		OnRecvPlay(*itor, data);		break;
-	case kStateEnd:			OnRecvEnd(*itor, data);			break;
-
-	default:
-		assert(0);
-		return;
-	}
-}
+		const PendingJoin& join = sPendingJoins[i];
+		const Matchmaking::JoinRequest& request = join.request;
 
+		if (join.client->IsClosed())
+		{
+			// gone since it asked. deleted once this Update() is over.
+			continue;
+		}
 
-void SnakeCyclesService::AddClient(PollingSocket* client)
-{
-	assert(mFSM.GetState() == kStateWait || mFSM.GetState() == kStateCountdown);
-	assert(mPlayers.size() < kMaxPlayers);
+		SnakeCyclesService* service = NULL;
+		if (!Matchmaking::Resolve(request, sOpenSeats, sJoinCodes, sServices, service))
+		{
+			MessageWriter writer;
+			Matchmaking::WriteJoinFailed(writer, GetMessageType(), request);
+			join.client->PostSend(writer.GetData(), writer.GetSize());
+			continue;
+		}
 
-	Player newPlayer(client);
-	mPlayers.push_back(newPlayer);
-}
+		if (service != NULL && join.client->GetSession().room == service)
+		{
+			// already playing there.
+			continue;
+		}
 
+		// a connection plays in one room at a time. the one it is in is left only now that there is another.
+		Server::Instance()->LeaveRoom(join.client);
 
-bool SnakeCyclesService::RemoveClientInternal(PollingSocket* client)
-{
-	auto itor = std::find_if(mPlayers.begin(), mPlayers.end(), [client](const Player& player){ return player.GetClient() == client; } );
-	if (itor != mPlayers.end())
-	{
-		if (mWinner == itor->GetIndex())
+		bool acquired = service == NULL;
+		if (acquired)
 		{
-			LOG("SnakeCyclesService::RemoveClientInternal() - winner[%d] left the game.", mWinner);
-			mWinner = kPlayerNone;
+			service = sServices.Acquire();
+			service->mStats.Reset();
+			service->Configure(join.config);
+			service->mBucket = request.bucket;
+			if (request.kind == Matchmaking::JoinRequest::kJoinNewPrivate)
+			{
+				sJoinCodes.Assign(*service);
+			}
+			service->OpenSeat();
+			AssignPhaseSlot(service);
+			AssignShard(service);
 		}
-		mPlayers.erase(itor);
-		return true;
-	}
-	return false;
-}
 
+		service->AddClient(join.client);
+		if (acquired)
+		{
+			// only whoever made the room fills it. a joiner asking for bots is not heard.
+			service->AddBots(join.bots);
+		}
 
-void SnakeCyclesService::CheckPlayerConnection()
-{
-	if (mFSM.GetState() == kStateCountdown || mFSM.GetState() == kStatePlay)
-	{
-		if (mPlayers.size() < kMinPlayers)
+		if (Matchmaking::WriteJoined(service->mWriter, GetMessageType(), *service))
 		{
-			mFSM.SetState(kStateEnd);
+			service->Send(join.client, service->mWriter);
 		}
 	}
-}
-
+	sPendingJoins.clear();
 
-void SnakeCyclesService::Send(PollingSocket* client, rapidjson::Document& data) const
-{
-	client->AsyncSend(data);
-}
+	// the snake rooms the joins took players from let them go before the next ticks.
+	ApplyLeaves();
 
+	ReportSlotLoad();
 
-void SnakeCyclesService::Broadcast(rapidjson::Document& data) const
-{
-	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	if (sListing.IsStale())
 	{
-		Send(mPlayers[i].GetClient(), data);
+		sListing.Rebuild(sServices.GetActive());
 	}
-}
 
-void SnakeCyclesService::SetPlayerName(Player& player, rapidjson::Document& data)
-{
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "snakecycles")
+	// the spectators catch up on the last ticks before the next ones start.
+	const ServicePool::RoomList& services = sServices.GetActive();
+	for (size_t i = 0 ; i < services.size() ; ++i)
 	{
-		assert(data["name"].IsString());
-		player.SetName(data["name"].GetString());
+		services[i]->mChannel.Flush();
 	}
-}
 
-// Wait
-void SnakeCyclesService::OnEnterWait(int nPrevState)
-{
-	LOG("SnakeCyclesService::OnEnterWait()");
-	mWinner = kPlayerNone;
-}
+	// then the rooms run the ticks that fell due on the workers, all of them from the same tick.
+	int numTicks = TakeDueTicks();
+	if (numTicks == 0 || services.empty())
+	{
+		return;
+	}
 
-void SnakeCyclesService::OnUpdateWait(double elapsed)
-{
-	if (mPlayers.size() >= kMinPlayers)
+	TaskPool* pool = TaskPool::Instance();
+	if (sBatchMovement)
 	{
-		mFSM.SetState(kStateCountdown);
+		for (size_t i = 0 ; i < sShards.size() ; ++i)
+		{
+			if (!sShards[i].rooms.empty())
+			{
+				pool->Submit(boost::bind(&SnakeCyclesService::UpdateShard, &sShards[i], sTick, numTicks));
+			}
+		}
 	}
-}
+	else
+	{
+		for (size_t i = 0 ; i < services.size() ; ++i)
+		{
+			pool->Submit(boost::bind(&SnakeCyclesService::UpdateInternal, services[i], sTick, numTicks));
+		}
+	}
+	pool->Start();
 
-void SnakeCyclesService::OnRecvWait(Player& player, rapidjson::Document& data)
-{
+	sTick += numTicks;
 }
 
-void SnakeCyclesService::OnLeaveWait(int nNextState)
+/*static*/ void SnakeCyclesService::SetTickRate(int ticksPerSecond)
 {
-	LOG("SnakeCyclesService::OnLeaveWait()");
+	sTickRate = std::max(ticksPerSecond, 1);
 }
 
-// Countdown
-void SnakeCyclesService::SendCountdown() const
+/*static*/ void SnakeCyclesService::SetTicksPerBlock(int ticksPerBlock)
 {
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "snakecycles", data.GetAllocator());
-	data.AddMember("subtype", "countdown", data.GetAllocator());
-	data.AddMember("number", mCountdownSent, data.GetAllocator());
-	Broadcast(data);
+	sTicksPerBlock = std::max(ticksPerBlock, 1);
 }
 
-void SnakeCyclesService::OnEnterCountdown(int nPrevState)
+/*static*/ void SnakeCyclesService::SetRecordReplays(const char* directory, int maxFiles)
 {
-	LOG("SnakeCyclesService::OnEnterCountdown()");
-	mCoutdownRemaing = 1;
-	mCountdownSent = kInitCountdown;
-	SendCountdown();
+	sReplayDirectory = directory;
+	sMaxReplays = std::max(maxFiles, 0);
 }
 
-void SnakeCyclesService::OnUpdateCountdown(double elapsed)
+/*static*/ int SnakeCyclesService::TakeDueTicks()
 {
-	mCoutdownRemaing -= elapsed;
+	// read once per batch. every room of the batch runs on the same time.
+	long long now = GetPerformanceCounter();
+	sTickAccumulator += now - sLastTickTime;
+	sLastTickTime = now;
+
+	long long step = GetPerformanceFrequency() / sTickRate;
+	long long numTicks = sTickAccumulator / step;
+	sTickAccumulator -= numTicks * step;
 
-	if (mCoutdownRemaing <= 0)
+	if (numTicks > kMaxTicksPerBatch)
 	{
-		assert(mCountdownSent > 0);
+		LOG("SnakeCyclesService::TakeDueTicks() - %lld ticks behind. dropped.", numTicks - kMaxTicksPerBatch);
+		numTicks = kMaxTicksPerBatch;
+	}
 
-		mCoutdownRemaing = 1;
-		--mCountdownSent;
+	return static_cast<int>(numTicks);
+}
 
-		if (mCountdownSent == 0) 
-		{
-			mFSM.SetState(kStatePlay);
-		}
-		else
+/*static*/ void SnakeCyclesService::OnRecv(PollingSocket* client, Message& message)
+{
+	if (CreateOrEnter(client, message))
+	{
+		return;
+	}
+
+	Session& session = client->GetSession();
+	if (session.IsBoundTo(Session::kServiceSnakeCycles))
+	{
+		Input input;
+		if (ReadInput(message, input))
 		{
-			SendCountdown();
+			input.client = client;
+			input.slot = session.slot;
+			static_cast<SnakeCyclesService*>(session.room)->PushInput(input);
 		}
 	}
 }
 
-void SnakeCyclesService::OnRecvCountdown(Player& player, rapidjson::Document& data)
+/*static*/ void SnakeCyclesService::RemoveClient(PollingSocket* client)
 {
+	Session& session = client->GetSession();
+	if (session.IsBoundTo(Session::kServiceSnakeCycles))
+	{
+		PendingLeave leave;
+		leave.service = static_cast<SnakeCyclesService*>(session.room);
+		leave.client = client;
+		sPendingLeaves.push_back(leave);
+
+		// the connection is free for another service right away.
+		session.Clear();
+	}
 }
 
-void SnakeCyclesService::OnLeaveCountdown(int nNextState)
+/*static*/ void SnakeCyclesService::ListRooms(PollingSocket* client, Message& message)
 {
-	LOG("SnakeCyclesService::OnLeaveCountdown()");
-}
+	// the rooms may be ticking. the listing is the copy Update() wrote.
+	int page = 0;
+	message.GetInt("page", page);
 
+	const MessageWriter& writer = sListing.GetPage(page);
+	client->AsyncSend(writer.GetData(), writer.GetSize());
+}
 
-// Play
-void SnakeCyclesService::SendPlayerIndex(const Player& player) const
+/*static*/ void SnakeCyclesService::CollectStats(RoomStatsReport::EntryList& entries)
 {
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "snakecycles", data.GetAllocator());
-	data.AddMember("subtype", "playerindex", data.GetAllocator());
-	data.AddMember("playerindex", static_cast<int>(player.GetIndex()), data.GetAllocator());
-
-	Send(player.GetClient(), data);
+	RoomStatsReport::Collect(GetMessageType(), sServices, entries);
 }
 
-void SnakeCyclesService::SendPlay() const
+/*static*/ void SnakeCyclesService::Spectate(PollingSocket* client, Message& message)
 {
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "snakecycles", data.GetAllocator());
-	data.AddMember("subtype", "play", data.GetAllocator());
+	int roomId = 0;
+	message.GetInt("room", roomId);
 
-	rapidjson::Value players(rapidjson::kArrayType);
-	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	SnakeCyclesService* service = sServices.Find(roomId);
+	if (service == NULL)
 	{
-		rapidjson::Value playerStatus(rapidjson::kObjectType);
-		mPlayers[i].GetStatus(playerStatus, data.GetAllocator());
-		players.PushBack(playerStatus, data.GetAllocator());
+		LOG("SnakeCyclesService::Spectate() - room[%d] is not found. ignored.", roomId);
+		return;
 	}
 
-	data.AddMember("players", players, data.GetAllocator());
-
-	Broadcast(data);
+	// the snapshot goes out with the next Update().
+	service->mChannel.Subscribe(client);
 }
 
-void SnakeCyclesService::SendMove(const std::vector<Wall>& newWalls) const
+/*static*/ bool SnakeCyclesService::CreateOrEnter(PollingSocket* client, Message& message)
 {
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "snakecycles", data.GetAllocator());
-	data.AddMember("subtype", "move", data.GetAllocator());
+	if (message.IsType("service_create"))
+	{
+		std::string name;
+		message.GetString("name", name);
+
+		if (name == "snakecycles")
+		{
+			PendingJoin join;
+			join.client = client;
+			join.request = Matchmaking::ReadJoinRequest(message);
+
+			std::string mode;
+			message.GetString("mode", mode);
+			join.config = FindRoomConfig(mode);
 
-	// add new wallls
-	rapidjson::Value walls(rapidjson::kArrayType);
-	for (size_t i = 0 ; i < newWalls.size() ; ++i)
-	{			
-		rapidjson::Value wall(rapidjson::kObjectType);
+			join.bots = 0;
+			message.GetInt("bots", join.bots);
 
-		wall.AddMember("x", newWalls[i].pos.x, data.GetAllocator());
-		wall.AddMember("y", newWalls[i].pos.y, data.GetAllocator());
-		wall.AddMember("playerIndex", static_cast<int>(newWalls[i].playerIndex), data.GetAllocator());
+			// a room type is matched only with itself.
+			join.request.bucket.insert(0, std::string(join.config->mode) + "/");
 
-		walls.PushBack(wall, data.GetAllocator());
+			// it stays in the room it is in until the join is applied. the last one asked for counts.
+			auto itor = std::find_if(sPendingJoins.begin(), sPendingJoins.end(), [client](const PendingJoin& pending){ return pending.client == client; } );
+			if (itor != sPendingJoins.end())
+			{
+				*itor = join;
+			}
+			else
+			{
+				sPendingJoins.push_back(join);
+			}
+			return true;
+		}
 	}
-	data.AddMember("walls", walls, data.GetAllocator());
+	return false;
+}
 
-	// update player status
-	rapidjson::Value players(rapidjson::kArrayType);
+/*static*/ const SnakeCyclesService::RoomConfig* SnakeCyclesService::FindRoomConfig(const std::string& mode)
+{
+	for (size_t i = 0 ; i < sizeof(sRoomConfigs) / sizeof(sRoomConfigs[0]) ; ++i)
+	{
+		if (mode == sRoomConfigs[i].mode)
+		{
+			return &sRoomConfigs[i];
+		}
+	}
 
-	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	if (!mode.empty())
 	{
-		rapidjson::Value playerStatus(rapidjson::kObjectType);
-		mPlayers[i].GetStatus(playerStatus, data.GetAllocator());
-		players.PushBack(playerStatus, data.GetAllocator());
+		LOG("SnakeCyclesService::FindRoomConfig() - unknown mode [%s]. classic is used.", mode.c_str());
 	}
-	data.AddMember("players", players, data.GetAllocator());
+	return &sRoomConfigs[0];
+}
+
+/*static*/ void SnakeCyclesService::AssignPhaseSlot(SnakeCyclesService* service)
+{
+	int slot = static_cast<int>(std::min_element(sSlotRooms, sSlotRooms + kPhaseSlots) - sSlotRooms);
+	++sSlotRooms[slot];
 
-	Broadcast(data);
+	service->mPhaseSlot = slot;
+	service->mWalls = 0;
 }
 
-void SnakeCyclesService::OnEnterPlay(int nPrevState)
+/*static*/ void SnakeCyclesService::ReleasePhaseSlot(SnakeCyclesService* service)
 {
-	LOG("SnakeCyclesService::OnEnterPlay()");
+	assert(service->mPhaseSlot >= 0 && sSlotRooms[service->mPhaseSlot] > 0);
 
-	assert(mWinner == kPlayerNone);
+	sSlotWalls[service->mPhaseSlot] += service->mWalls;
+	--sSlotRooms[service->mPhaseSlot];
+
+	service->mPhaseSlot = -1;
+	service->mWalls = 0;
+}
 
-	for (size_t i = 0 ; i < kCellRows*kCellColumns ; ++i)
+/*static*/ void SnakeCyclesService::ReportSlotLoad()
+{
+	// no room is ticking. their counters are safe to collect.
+	const ServicePool::RoomList& services = sServices.GetActive();
+	for (size_t i = 0 ; i < services.size() ; ++i)
 	{
-		mBoard[i] = kPlayerNone;
+		sSlotWalls[services[i]->mPhaseSlot] += services[i]->mWalls;
+		services[i]->mWalls = 0;
 	}
 
-	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	unsigned int now = GetTickCount();
+	if (now - sLastSlotReport < kSlotReportInterval)
+	{
+		return;
+	}
+	sLastSlotReport = now;
+
+	if (services.empty())
 	{
-		mPlayers[i].Init(static_cast<PlayerIndex>(i), mBoard, kCellRows, kCellColumns);
+		std::fill(sSlotWalls, sSlotWalls + kPhaseSlots, 0);
+		return;
 	}
 
-	// send player index
-	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	// rooms / walls per slot. an even load has the same numbers in every slot.
+	std::ostringstream load;
+	for (int slot = 0 ; slot < kPhaseSlots ; ++slot)
 	{
-		SendPlayerIndex(mPlayers[i]);
+		load << " " << sSlotRooms[slot] << "/" << sSlotWalls[slot];
 	}
+	std::fill(sSlotWalls, sSlotWalls + kPhaseSlots, 0);
 
-	// send play!
-	SendPlay();
+	LOG("SnakeCyclesService::ReportSlotLoad() - rooms/walls per slot :%s", load.str().c_str());
 }
 
-void SnakeCyclesService::OnUpdatePlay(double elapsed)
+/*static*/ bool SnakeCyclesService::ReadInput(Message& message, Input& input)
 {
+	if (message.IsSubtype("dir"))
+	{
+		int dir = 0;
+		if (message.GetInt("dir", dir) && dir >= kUP && dir <= kRIGHT)
+		{
+			input.type = Input::kInputDir;
+			input.dir = static_cast<Direction>(dir);
+			message.GetInt("step", input.frame);
+			message.GetInt("seq", input.seq);
+			return true;
+		}
+	}
+	else if (message.IsSubtype("restart"))
+	{
+		input.type = Input::kInputRestart;
+		return true;
+	}
+	else if (message.IsSubtype("checksum"))
+	{
+		// an unsigned 32 bit number. the same bits sent as a signed one are taken too.
+		int bits = 0;
+		bool hasChecksum = message.GetUint("checksum", input.checksum);
+		if (!hasChecksum && message.GetInt("checksum", bits))
+		{
+			input.checksum = static_cast<unsigned int>(bits);
+			hasChecksum = true;
+		}
+
+		if (message.GetInt("step", input.frame) && hasChecksum)
+		{
+			input.type = Input::kInputChecksum;
+			return true;
+		}
+	}
+	else if (message.IsSubtype("ack"))
+	{
+		if (message.GetInt("frame", input.frame))
+		{
+			input.type = Input::kInputAck;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*static*/ void SnakeCyclesService::ApplyLeaves()
+{
+	for (size_t i = 0 ; i < sPendingLeaves.size() ; ++i)
+	{
+		sPendingLeaves[i].service->RemoveClientInternal(sPendingLeaves[i].client);
+	}
+	sPendingLeaves.clear();
+}
+
+/*static*/ void SnakeCyclesService::Flush()
+{
+	// backwards, so the room swapped into a released slot is already checked.
+	const ServicePool::RoomList& services = sServices.GetActive();
+	for (size_t i = services.size() ; i > 0 ; --i)
+	{
+		SnakeCyclesService* service = services[i - 1];
+
+		// bots do not keep a room open.
+		if (service->mFSM.GetState() == kStateWait && !service->HasHumans())
+		{
+			service->mPlayers.clear();
+			sOpenSeats.Close(*service);
+			sJoinCodes.Reclaim(*service);
+			service->mChannel.Close();
+			ReleasePhaseSlot(service);
+			ReleaseShard(service);
+			sServices.Release(service);
+		}
+		else
+		{
+			service->SyncSeat();
+		}
+	}
+}
+
+/*static*/ void SnakeCyclesService::AssignShard(SnakeCyclesService* service)
+{
+	if (sShards.empty())
+	{
+		return;
+	}
+
+	// the fewest rooms. a shard is one task, so they should come out about the same length.
+	size_t best = 0;
+	for (size_t i = 1 ; i < sShards.size() ; ++i)
+	{
+		if (sShards[i].rooms.size() < sShards[best].rooms.size())
+		{
+			best = i;
+		}
+	}
+
+	sShards[best].rooms.push_back(service);
+	service->mShard = static_cast<int>(best);
+}
+
+/*static*/ void SnakeCyclesService::ReleaseShard(SnakeCyclesService* service)
+{
+	if (service->mShard < 0)
+	{
+		return;
+	}
+
+	if (service->mInEngine)
+	{
+		service->LeaveEngine();
+	}
+
+	std::vector<SnakeCyclesService*>& rooms = sShards[service->mShard].rooms;
+	rooms.erase(std::find(rooms.begin(), rooms.end(), service));
+	service->mShard = -1;
+}
+
+/*static*/ void SnakeCyclesService::UpdateShard(Shard* shard, unsigned int firstTick, int numTicks)
+{
+	shard->stepped.clear();
+	shard->steered.clear();
+
+	for (size_t i = 0 ; i < shard->rooms.size() ; ++i)
+	{
+		SnakeCyclesService* service = shard->rooms[i];
+		service->BeginBatch(firstTick);
+
+		if (!service->mInEngine)
+		{
+			shard->stepped.push_back(service);
+		}
+		else if (service->HasBots())
+		{
+			shard->steered.push_back(service);
+		}
+	}
+
+	for (int i = 0 ; i < numTicks ; ++i)
+	{
+		unsigned int tick = firstTick + i;
+
+		// the same order as Step() : the bots turn, then everyone moves.
+		for (size_t j = 0 ; j < shard->steered.size() ; ++j)
+		{
+			SnakeCyclesService* service = shard->steered[j];
+			if (!service->mInEngine)
+			{
+				continue;
+			}
+
+			RoomStats::Scope scope(service->mStats);
+			service->SteerBots();
+		}
+
+		shard->engine.Step(sTicksPerBlock);
+
+		shard->moved.clear();
+		const std::vector<int>& moved = shard->engine.GetMoved();
+		for (size_t j = 0 ; j < moved.size() ; ++j)
+		{
+			SnakeCyclesService* service = static_cast<SnakeCyclesService*>(shard->engine.GetOwner(moved[j]));
+			if (service->mEngineTick != tick)
+			{
+				service->mEngineTick = tick;
+				shard->moved.push_back(service);
+			}
+		}
+
+		for (size_t j = 0 ; j < shard->moved.size() ; ++j)
+		{
+			shard->moved[j]->OnEngineMoved(tick);
+		}
+
+		// a room that starts playing here is in the engine from the next tick.
+		for (size_t j = 0 ; j < shard->stepped.size() ; ++j)
+		{
+			SnakeCyclesService* service = shard->stepped[j];
+			if (service->mInEngine)
+			{
+				continue;
+			}
+
+			service->StepAt(tick);
+			if (service->mInEngine && service->HasBots())
+			{
+				shard->steered.push_back(service);
+			}
+		}
+
+		// a room whose game ended on this tick steps through the rest of the batch as usual.
+		for (size_t j = 0 ; j < shard->moved.size() ; ++j)
+		{
+			SnakeCyclesService* service = shard->moved[j];
+			if (!service->mInEngine && std::find(shard->stepped.begin(), shard->stepped.end(), service) == shard->stepped.end())
+			{
+				shard->stepped.push_back(service);
+			}
+		}
+	}
+
+	for (size_t i = 0 ; i < shard->rooms.size() ; ++i)
+	{
+		SnakeCyclesService* service = shard->rooms[i];
+		if (service->mInEngine)
+		{
+			service->mTick = firstTick + numTicks - 1;
+			service->mPlayTick = service->mTick - service->mPlayStartTick;
+		}
+	}
+}
+
+SnakeCyclesService::SnakeCyclesService(void)
+	: mConfig(NULL)
+	, mHeadShift(32)
+	, mPlayTick(0)
+	, mPlayStartTick(0)
+	, mShard(-1)
+	, mInEngine(false)
+	, mEngineTick(static_cast<unsigned int>(-1))
+	, mTick(0)
+	, mCountdownTicks(0)
+	, mCountdownSent(0)
+	, mWinner(kPlayerNone)
+	, mFrame(0)
+	, mKeyframeNumber(-1)
+	, mBoardHash(0)
+	, mPhaseSlot(-1)
+	, mWalls(0)
+	, mInputs(kMaxInputs)
+{
+	mChannel.Init(boost::bind(&SnakeCyclesService::WriteSnapshot, this, _1),
+				  boost::bind(&SnakeCyclesService::WriteDelta, this, _1),
+				  &mStats);
+
+	Configure(&sRoomConfigs[0]);
+
+	InitFSM();
+}
+
+
+SnakeCyclesService::~SnakeCyclesService(void)
+{
+	ShutdownFSM();
+}
+
+void SnakeCyclesService::InitFSM()
+{
+#define BIND_CALLBACKS(State) boost::bind(&SnakeCyclesService::OnEnter##State, this, _1), \
+							  boost::bind(&SnakeCyclesService::DummyUpdate, this, _1), \
+							  boost::bind(&SnakeCyclesService::OnLeave##State, this, _1)
+
+	mFSM.RegisterState(kStateWait, BIND_CALLBACKS(Wait));
+	mFSM.RegisterState(kStateCountdown, BIND_CALLBACKS(Countdown));
+	mFSM.RegisterState(kStatePlay, BIND_CALLBACKS(Play));
+	mFSM.RegisterState(kStateEnd, BIND_CALLBACKS(End));
+
+#undef BIND_CALLBACKS
+
+	mFSM.SetState(kStateWait);
+}
+
+void SnakeCyclesService::ShutdownFSM()
+{
+	mFSM.Reset(false);
+}
+
+
+void SnakeCyclesService::UpdateInternal(unsigned int firstTick, int numTicks)
+{
+	RoomStats::Scope scope(mStats);
+
+	// what arrived since the last batch applies from its first tick.
+	Input input;
+	while (mInputs.Pop(input))
+	{
+		OnRecvInternal(input);
+	}
+
+	for (int i = 0 ; i < numTicks ; ++i)
+	{
+		mTick = firstTick + i;
+		Step();
+	}
+}
+
+
+void SnakeCyclesService::BeginBatch(unsigned int firstTick)
+{
+	RoomStats::Scope scope(mStats);
+
+	// the room stands where UpdateInternal() would leave it before its first tick.
+	if (mInEngine)
+	{
+		mTick = firstTick - 1;
+		mPlayTick = mTick - mPlayStartTick;
+	}
+
+	Input input;
+	while (mInputs.Pop(input))
+	{
+		OnRecvInternal(input);
+	}
+
+	// the only way out of play. nothing in the batch changes the players.
+	if (mInEngine)
+	{
+		mTick = firstTick;
+		CheckPlayerConnection();
+	}
+}
+
+
+void SnakeCyclesService::StepAt(unsigned int tick)
+{
+	RoomStats::Scope scope(mStats);
+
+	mTick = tick;
+	Step();
+}
+
+
+void SnakeCyclesService::OnEngineMoved(unsigned int tick)
+{
+	RoomStats::Scope scope(mStats);
+
+	mTick = tick;
+	mPlayTick = tick - mPlayStartTick - 1;
+
+	SnakeMoveEngine& engine = GetEngine();
+
+	std::vector<Wall> newWalls;
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		Player& player = mPlayers[i];
+		int slot = player.GetSlot();
+		if (slot < 0)
+		{
+			continue;
+		}
+
+		Position pos;
+		pos.x = engine.GetX(slot);
+		pos.y = engine.GetY(slot);
+		if (pos.x != player.GetPos().x || pos.y != player.GetPos().y)
+		{
+			Wall wall;
+			player.MoveTo(mBoard, wall, pos);
+			StageTurn(player);
+			newWalls.push_back(wall);
+		}
+	}
+	OnBlocksMoved(newWalls);
+
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		if (mPlayers[i].GetSlot() >= 0)
+		{
+			engine.SetActive(mPlayers[i].GetSlot(), mPlayers[i].GetState() == Player::kStateAlive);
+		}
+	}
+
+	mPlayTick = tick - mPlayStartTick;
+}
+
+
+void SnakeCyclesService::EnterEngine()
+{
+	SnakeMoveEngine& engine = GetEngine();
+
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		Player& player = mPlayers[i];
+		Direction dir = player.GetNextDir();
+
+		int slot = engine.Add(this, player.GetPos().x, player.GetPos().y, kStepX[dir], kStepY[dir], player.GetTicksRemaining());
+		engine.SetActive(slot, player.GetState() == Player::kStateAlive);
+		player.SetSlot(slot);
+	}
+	mInEngine = true;
+}
+
+
+void SnakeCyclesService::LeaveEngine()
+{
+	SnakeMoveEngine& engine = GetEngine();
+
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		Player& player = mPlayers[i];
+		if (player.GetSlot() >= 0)
+		{
+			player.SetTicksRemaining(engine.GetTicks(player.GetSlot()));
+			engine.Remove(player.GetSlot());
+			player.SetSlot(-1);
+		}
+	}
+	mInEngine = false;
+}
+
+
+void SnakeCyclesService::StageTurn(const Player& player)
+{
+	if (player.GetSlot() >= 0)
+	{
+		Direction dir = player.GetNextDir();
+		GetEngine().SetStep(player.GetSlot(), kStepX[dir], kStepY[dir]);
+	}
+}
+
+
+bool SnakeCyclesService::IsMovingNext(const Player& player) const
+{
+	return player.GetSlot() >= 0 ? GetEngine().GetTicks(player.GetSlot()) <= 1 : player.IsMovingNext();
+}
+
+
+bool SnakeCyclesService::HasBots() const
+{
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		if (mPlayers[i].IsBot())
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void SnakeCyclesService::Step()
+{
+	// one fixed step. nothing in it reads the clock, so the same inputs play out the same.
+	CheckPlayerConnection();
+
+	switch(mFSM.GetState())
+	{
+	case kStateWait:		OnUpdateWait();			break;
+	case kStateCountdown:	OnUpdateCountdown();	break;
+	case kStatePlay:		OnUpdatePlay();			break;
+	case kStateEnd:			OnUpdateEnd();			break;
+
+	default:
+		assert(0);
+		return;
+	}
+}
+
+
+void SnakeCyclesService::PushInput(const Input& input)
+{
+	if (!mInputs.Push(input))
+	{
+		LOG("SnakeCyclesService::PushInput() - input queue is full. ignored.");
+	}
+}
+
+
+void SnakeCyclesService::OnRecvInternal(const Input& input)
+{
+	++mStats.messagesIn;
+
+	// seats are renumbered when someone leaves between the push and this tick.
+	PlayerList::iterator itor = mPlayers.end();
+	if (input.slot >= 0 && input.slot < static_cast<int>(mPlayers.size()) && mPlayers[input.slot].GetClient() == input.client)
+	{
+		itor = mPlayers.begin() + input.slot;
+	}
+	else
+	{
+		itor = std::find_if(mPlayers.begin(), mPlayers.end(), [&input](const Player& player){ return player.GetClient() == input.client; } );
+		if (itor == mPlayers.end())
+		{
+			return;
+		}
+	}
+
+	Player& player = *itor;
+
+	switch(mFSM.GetState())
+	{
+	case kStateWait:		OnRecvWait(player, input);		break;
+	case kStateCountdown:	OnRecvCountdown(player, input);	break;
+	case kStatePlay:		OnRecvPlay(player, input);		break;
+	case kStateEnd:			OnRecvEnd(player, input);			break;
+
+	default:
+		assert(0);
+		return;
+	}
+}
+
+
+void SnakeCyclesService::Configure(const RoomConfig* config)
+{
+	assert(mPlayers.empty());
+	assert(config->maxPlayers < kPlayerNone);
+
+	mConfig = config;
+	mBoard.Resize(mConfig->rows, mConfig->columns);
+	mPlayers.reserve(mConfig->maxPlayers);
+
+	// at most half full, so a probe stays short.
+	size_t numSlots = 1;
+	mHeadShift = 32;
+	while (numSlots < static_cast<size_t>(mConfig->maxPlayers) * 2)
+	{
+		numSlots <<= 1;
+		--mHeadShift;
+	}
+	mHeads.resize(numSlots);
+}
+
+
+SnakeCyclesService::HeadSlot& SnakeCyclesService::FindHead(int cell)
+{
+	size_t mask = mHeads.size() - 1;
+	size_t index = mHeadShift < 32 ? (static_cast<unsigned int>(cell) * 2654435761u) >> mHeadShift : 0;
+
+	while (mHeads[index].cell != cell && mHeads[index].cell != -1)
+	{
+		index = (index + 1) & mask;
+	}
+	return mHeads[index];
+}
+
+
+void SnakeCyclesService::ResolveCollisions()
+{
+	// every head counts, the dead ones too, as they are left where they crashed.
+	// a head off the board has no cell and is caught by IsBlocked() anyway.
+	std::fill(mHeads.begin(), mHeads.end(), HeadSlot());
+
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		const Position& pos = mPlayers[i].GetPos();
+		if (mBoard.IsInside(pos.x, pos.y))
+		{
+			HeadSlot& slot = FindHead(mBoard.GetIndex(pos.x, pos.y));
+			slot.cell = mBoard.GetIndex(pos.x, pos.y);
+			++slot.count;
+		}
+	}
+
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		const Position& pos = mPlayers[i].GetPos();
+		bool headOn = mBoard.IsInside(pos.x, pos.y) && FindHead(mBoard.GetIndex(pos.x, pos.y)).count > 1;
+
+		mPlayers[i].CheckCollision(mBoard, headOn);
+	}
+}
+
+
+void SnakeCyclesService::AddBots(int count)
+{
+	assert(mFSM.GetState() == kStateWait || mFSM.GetState() == kStateCountdown);
+
+	count = std::min(count, mConfig->maxPlayers - static_cast<int>(mPlayers.size()));
+	for (int i = 0 ; i < count ; ++i)
+	{
+		mPlayers.push_back(Player(NULL, true));
+	}
+
+	if (static_cast<int>(mPlayers.size()) == mConfig->maxPlayers)
+	{
+		sOpenSeats.Close(*this);
+	}
+
+	mChannel.Touch();
+}
+
+
+bool SnakeCyclesService::HasHumans() const
+{
+	return std::find_if(mPlayers.begin(), mPlayers.end(), [](const Player& player){ return !player.IsBot(); } ) != mPlayers.end();
+}
+
+
+void SnakeCyclesService::AddClient(PollingSocket* client)
+{
+	assert(mFSM.GetState() == kStateWait || mFSM.GetState() == kStateCountdown);
+	assert(static_cast<int>(mPlayers.size()) < mConfig->maxPlayers);
+
+	Player newPlayer(client, false);
+	mPlayers.push_back(newPlayer);
+
+	client->GetSession().Bind(Session::kServiceSnakeCycles, this, static_cast<int>(mPlayers.size()) - 1);
+
+	if (static_cast<int>(mPlayers.size()) == mConfig->maxPlayers)
+	{
+		sOpenSeats.Close(*this);
+	}
+
+	mChannel.Touch();
+}
+
+
+bool SnakeCyclesService::RemoveClientInternal(PollingSocket* client)
+{
+	auto itor = std::find_if(mPlayers.begin(), mPlayers.end(), [client](const Player& player){ return player.GetClient() == client; } );
+	if (itor != mPlayers.end())
+	{
+		RemovePlayer(itor);
+		return true;
+	}
+	return false;
+}
+
+
+void SnakeCyclesService::RemovePlayer(PlayerList::iterator itor)
+{
+	if (mWinner == itor->GetIndex())
+	{
+		LOG("SnakeCyclesService::RemovePlayer() - winner[%d] left the game.", mWinner);
+		mWinner = kPlayerNone;
+	}
+
+	if (mFSM.GetState() == kStatePlay)
+	{
+		mReplay.Append(mPlayTick, SnakeReplay::Record::kLeave, itor->GetIndex(), 0);
+
+		if (mConfig->lockstep)
+		{
+			mLeftPlayers.push_back(itor->GetIndex());
+		}
+	}
+
+	if (itor->GetSlot() >= 0)
+	{
+		GetEngine().Remove(itor->GetSlot());
+	}
+	itor = mPlayers.erase(itor);
+	mKeyframeNumber = -1;
+
+	// the players behind moved up a seat.
+	for ( ; itor != mPlayers.end() ; ++itor)
+	{
+		if (itor->GetClient() == NULL)
+		{
+			continue;
+		}
+
+		Session& session = itor->GetClient()->GetSession();
+		if (session.room == this)
+		{
+			session.slot = static_cast<int>(itor - mPlayers.begin());
+		}
+	}
+
+	if (mFSM.GetState() == kStateWait || mFSM.GetState() == kStateCountdown)
+	{
+		OpenSeat();
+	}
+
+	mChannel.Touch();
+}
+
+
+void SnakeCyclesService::SyncSeat()
+{
+	// state changes happen on the workers, which cannot touch the shared queues.
+	// they are caught up here between ticks.
+	if (HasOpenSeat())
+	{
+		OpenSeat();
+	}
+	else
+	{
+		sOpenSeats.Close(*this);
+	}
+}
+
+
+void SnakeCyclesService::OpenSeat()
+{
+	// rooms waiting in the pool are not matched, private ones only by their code.
+	if (IsPoolActive() && !IsPrivate())
+	{
+		sOpenSeats.Open(*this, mBucket);
+	}
+}
+
+
+bool SnakeCyclesService::HasOpenSeat()
+{
+	return (mFSM.GetState() == kStateWait || mFSM.GetState() == kStateCountdown) && static_cast<int>(mPlayers.size()) < mConfig->maxPlayers;
+}
+
+
+void SnakeCyclesService::WriteListEntry(MessageWriter& writer)
+{
+	writer.StartObject();
+	writer.Int("room", GetRoomId());
+	writer.Int("players", static_cast<int>(mPlayers.size()));
+	writer.Int("max_players", mConfig->maxPlayers);
+	writer.String("bucket", mBucket.c_str());
+	writer.EndObject();
+}
+
+
+int SnakeCyclesService::GetPhaseDelay() const
+{
+	// ticks until the block period next reaches the room's slot.
+	unsigned int period = static_cast<unsigned int>(sTicksPerBlock);
+	unsigned int slotPhase = period * mPhaseSlot / kPhaseSlots;
+	return static_cast<int>((slotPhase + period - mTick % period) % period);
+}
+
+
+void SnakeCyclesService::CheckPlayerConnection()
+{
+	if (mFSM.GetState() == kStateCountdown || mFSM.GetState() == kStatePlay)
+	{
+		if (static_cast<int>(mPlayers.size()) < mConfig->minPlayers || !HasHumans())
+		{
+			mFSM.SetState(kStateEnd);
+		}
+	}
+}
+
+
+void SnakeCyclesService::Send(PollingSocket* client, const MessageWriter& writer) const
+{
+	// a bot has no client.
+	if (client == NULL)
+	{
+		return;
+	}
+
+	// runs on a TaskPool worker. the I/O thread sends it.
+	client->PostSend(writer.GetData(), writer.GetSize());
+	mStats.OnSend(writer.GetSize());
+}
+
+
+void SnakeCyclesService::Broadcast(const MessageWriter& writer) const
+{
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		Send(mPlayers[i].GetClient(), writer);
+	}
+}
+
+void SnakeCyclesService::SetPlayerName(Player& player, Message& message)
+{
+	if (message.IsType("snakecycles"))
+	{
+		std::string name;
+		if (message.GetString("name", name))
+		{
+			player.SetName(name.c_str());
+		}
+	}
+}
+
+// Wait
+void SnakeCyclesService::OnEnterWait(int nPrevState)
+{
+	LOG("SnakeCyclesService::OnEnterWait()");
+	mWinner = kPlayerNone;
+	mChannel.Touch();
+}
+
+void SnakeCyclesService::OnUpdateWait()
+{
+	if (static_cast<int>(mPlayers.size()) >= mConfig->minPlayers && HasHumans())
+	{
+		mFSM.SetState(kStateCountdown);
+	}
+}
+
+void SnakeCyclesService::OnRecvWait(Player& player, const Input& input)
+{
+}
+
+void SnakeCyclesService::OnLeaveWait(int nNextState)
+{
+	LOG("SnakeCyclesService::OnLeaveWait()");
+}
+
+// Countdown
+void SnakeCyclesService::SendCountdown() const
+{
+	mWriter.Begin("snakecycles", "countdown");
+	mWriter.Int("number", mCountdownSent);
+	mWriter.End();
+	Broadcast(mWriter);
+}
+
+void SnakeCyclesService::OnEnterCountdown(int nPrevState)
+{
+	LOG("SnakeCyclesService::OnEnterCountdown()");
+	// the first number goes out right away. the rest of the countdown and the play
+	// that follows run on the room's phase.
+	mCountdownTicks = sTickRate + GetPhaseDelay();
+	mCountdownSent = kInitCountdown;
+	SendCountdown();
+	mChannel.Touch();
+}
+
+void SnakeCyclesService::OnUpdateCountdown()
+{
+	if (--mCountdownTicks <= 0)
+	{
+		assert(mCountdownSent > 0);
+
+		mCountdownTicks = sTickRate;
+		--mCountdownSent;
+
+		if (mCountdownSent == 0) 
+		{
+			mFSM.SetState(kStatePlay);
+		}
+		else
+		{
+			SendCountdown();
+		}
+	}
+}
+
+void SnakeCyclesService::OnRecvCountdown(Player& player, const Input& input)
+{
+}
+
+void SnakeCyclesService::OnLeaveCountdown(int nNextState)
+{
+	LOG("SnakeCyclesService::OnLeaveCountdown()");
+}
+
+
+// Play
+void SnakeCyclesService::SendPlayerIndex(const Player& player) const
+{
+	mWriter.Begin("snakecycles", "playerindex");
+	mWriter.Int("playerindex", static_cast<int>(player.GetIndex()));
+	mWriter.Int("room", GetRoomId());
+	mWriter.End();
+
+	Send(player.GetClient(), mWriter);
+}
+
+void SnakeCyclesService::SendPlay() const
+{
+	mWriter.Begin("snakecycles", "play");
+	mWriter.Int("rows", mConfig->rows);
+	mWriter.Int("columns", mConfig->columns);
+	mWriter.Int("lockstep", mConfig->lockstep ? 1 : 0);
+
+	mWriter.StartArray("players");
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		mPlayers[i].WriteStatus(mWriter);
+	}
+	mWriter.EndArray();
+
+	mWriter.End();
+	Broadcast(mWriter);
+}
+
+void SnakeCyclesService::RecordFrame(const std::vector<Wall>& newWalls)
+{
+	++mFrame;
+
+	Frame& frame = mHistory[mFrame % (kHistoryFrames + 1)];
+	frame.number = mFrame;
+	frame.walls = newWalls;
+
+	// players who left keep their last status. nobody is sent a diff for them.
+	frame.players.resize(mConfig->maxPlayers);
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		frame.players[mPlayers[i].GetIndex()] = mPlayers[i].GetStatus();
+	}
+
+	frame.checksum = ComputeChecksum();
+}
+
+unsigned int SnakeCyclesService::ComputeChecksum() const
+{
+	// what a lockstep client has to reproduce, in 32 bits wrapping:
+	//	the sum over the walls of (y * columns + x) * 31 + playerIndex, then
+	//	for each player by index, h = h * 31 + x, y, dir and state in turn.
+	unsigned int checksum = mBoardHash;
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		PlayerStatus status = mPlayers[i].GetStatus();
+		checksum = checksum * 31 + static_cast<unsigned int>(status.x);
+		checksum = checksum * 31 + static_cast<unsigned int>(status.y);
+		checksum = checksum * 31 + static_cast<unsigned int>(status.dir);
+		checksum = checksum * 31 + static_cast<unsigned int>(status.state);
+	}
+	return checksum;
+}
+
+void SnakeCyclesService::SendStep()
+{
+	// the directions that changed since the last step, and who left. the clients move
+	// everyone alive one block and resolve the collisions as ResolveCollisions() does.
+	const Frame& prev = GetFrame(mFrame - 1);
+	const Frame& frame = GetFrame(mFrame);
+
+	mWriter.Begin("snakecycles", "step");
+	mWriter.Int("step", mFrame);
+
+	mWriter.StartArray("dirs");
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		PlayerIndex index = mPlayers[i].GetIndex();
+		if (frame.players[index].dir != prev.players[index].dir)
+		{
+			mWriter.Int(static_cast<int>(index));
+			mWriter.Int(frame.players[index].dir);
+		}
+	}
+	mWriter.EndArray();
+
+	mWriter.StartArray("left");
+	for (size_t i = 0 ; i < mLeftPlayers.size() ; ++i)
+	{
+		mWriter.Int(static_cast<int>(mLeftPlayers[i]));
+	}
+	mWriter.EndArray();
+	mLeftPlayers.clear();
+
+	mWriter.End();
+	Broadcast(mWriter);
+}
+
+void SnakeCyclesService::SendKeyframe(Player& player)
+{
+	// the cached one holds while the step does. a turn is queued, not applied, until the next.
+	if (mKeyframeNumber != mFrame)
+	{
+		WriteKeyframe(mKeyframe);
+		mKeyframeNumber = mFrame;
+	}
+
+	player.SetResyncFrame(mFrame);
+	Send(player.GetClient(), mKeyframe);
+}
+
+void SnakeCyclesService::SendFrame()
+{
+	// the clients mostly ack the same frame, so a delta is built once and sent to each of them.
+	int deltaBase = -1;
+
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		Player& player = mPlayers[i];
+
+		if (player.IsBot())
+		{
+			continue;
+		}
+
+		if (player.GetSentFrame() - player.GetAckedFrame() > kMaxUnackedFrames)
+		{
+			// lagging. it is sent a delta or a keyframe from what it acks next.
+			continue;
+		}
+
+		int base = player.GetAckedFrame();
+		bool keyframeDue = (mFrame + player.GetIndex() * kKeyframeInterval / mConfig->maxPlayers) % kKeyframeInterval == 0;
+
+		if (keyframeDue || mFrame - base > kHistoryFrames || GetFrame(base).number != base)
+		{
+			if (mKeyframeNumber != mFrame)
+			{
+				WriteKeyframe(mKeyframe);
+				mKeyframeNumber = mFrame;
+			}
+			Send(player.GetClient(), mKeyframe);
+		}
+		else
+		{
+			if (deltaBase != base)
+			{
+				WriteFrameDelta(mWriter, base);
+				deltaBase = base;
+			}
+			Send(player.GetClient(), mWriter);
+		}
+
+		player.SetSentFrame(mFrame);
+	}
+}
+
+void SnakeCyclesService::WriteFrameDelta(MessageWriter& writer, int base) const
+{
+	writer.Begin("snakecycles", "move");
+	writer.Int("frame", mFrame);
+	writer.Int("base", base);
+
+	// the walls of every frame after the base, as x, y, playerIndex.
+	writer.StartArray("walls");
+	for (int number = base + 1 ; number <= mFrame ; ++number)
+	{
+		const std::vector<Wall>& walls = GetFrame(number).walls;
+		for (size_t i = 0 ; i < walls.size() ; ++i)
+		{
+			writer.Int(walls[i].pos.x);
+			writer.Int(walls[i].pos.y);
+			writer.Int(static_cast<int>(walls[i].playerIndex));
+		}
+	}
+	writer.EndArray();
+
+	// only the fields that changed since the base.
+	const Frame& baseFrame = GetFrame(base);
+	writer.StartArray("players");
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		const PlayerStatus& status = baseFrame.players[mPlayers[i].GetIndex()];
+		if (mPlayers[i].HasChanged(status))
+		{
+			mPlayers[i].WriteChanges(writer, status);
+		}
+	}
+	writer.EndArray();
+
+	writer.End();
+}
+
+void SnakeCyclesService::WriteKeyframe(MessageWriter& writer) const
+{
+	writer.Begin("snakecycles", "keyframe");
+	writer.Int("frame", mFrame);
+	writer.Int("rows", mConfig->rows);
+	writer.Int("columns", mConfig->columns);
+
+	// the board row by row in runs of length, owner. an empty run has the owner kPlayerNone.
+	writer.StartArray("board");
+	int numCells = mConfig->rows * mConfig->columns;
+	int runOwner = kPlayerNone;
+	int runLength = 0;
+	for (int index = 0 ; index < numCells ; )
+	{
+		int owner = kPlayerNone;
+		int length = 1;
+
+		unsigned long long bits = mBoard.GetWord(index >> 6);
+		if (bits == 0)
+		{
+			// 64 empty cells, or up to the end.
+			length = std::min(64, numCells - index);
+		}
+		else if ((bits >> (index & 63)) & 1)
+		{
+			owner = mBoard.GetOwnerAt(index);
+		}
+
+		if (owner != runOwner && runLength > 0)
+		{
+			writer.Int(runLength);
+			writer.Int(runOwner);
+			runLength = 0;
+		}
+		runOwner = owner;
+		runLength += length;
+		index += length;
+	}
+	if (runLength > 0)
+	{
+		writer.Int(runLength);
+		writer.Int(runOwner);
+	}
+	writer.EndArray();
+
+	writer.StartArray("players");
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		mPlayers[i].WriteStatus(writer);
+	}
+	writer.EndArray();
+
+	writer.End();
+}
+
+void SnakeCyclesService::OnEnterPlay(int nPrevState)
+{
+	LOG("SnakeCyclesService::OnEnterPlay()");
+
+	assert(mWinner == kPlayerNone);
+
+	mBoard.Reset();
+
+	int numPlayers = static_cast<int>(mPlayers.size());
+	for (int i = 0 ; i < numPlayers ; ++i)
+	{
+		mPlayers[i].Init(i, numPlayers, mConfig->rows, mConfig->columns);
+	}
+
+	// send player index
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		SendPlayerIndex(mPlayers[i]);
+	}
+
+	// send play! it is frame 0, and the clients are sent what changed from it.
+	SendPlay();
+
+	for (int i = 0 ; i <= kHistoryFrames ; ++i)
+	{
+		mHistory[i].number = -1;
+	}
+	mFrame = -1;
+	mBoardHash = 0;
+	mLeftPlayers.clear();
+	RecordFrame(std::vector<Wall>());
+	mKeyframeNumber = -1;
+
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		mPlayers[i].ResetFrames();
+	}
+
+	mPlayTick = 0;
+	mPlayStartTick = mTick;
+	if (!sReplayDirectory.empty())
+	{
+		StartReplay();
+	}
+
+	if (mShard >= 0)
+	{
+		EnterEngine();
+	}
+
+	// a new board. the spectators start over from a snapshot.
+	mSpectatorWalls.clear();
+	mChannel.Reset();
+}
+
+void SnakeCyclesService::SteerBots()
+{
+	// the bots turn just before their block, seeing the board as the tick found it.
+	mBotHeads.clear();
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		const Player& player = mPlayers[i];
+		if (player.GetState() == Player::kStateAlive)
+		{
+			SnakeBot::Head head = { player.GetPos().x, player.GetPos().y };
+			mBotHeads.push_back(head);
+		}
+	}
+
+	size_t alive = 0;
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		Player& player = mPlayers[i];
+		if (player.GetState() != Player::kStateAlive)
+		{
+			continue;
+		}
+
+		if (player.IsBot() && IsMovingNext(player))
+		{
+			const Position& pos = player.GetPos();
+			int dir = mBot.Choose(mBoard, pos.x, pos.y, static_cast<int>(player.GetDir()), mBotHeads, alive);
+			if (dir != static_cast<int>(player.GetDir()))
+			{
+				player.QueueTurn(static_cast<Direction>(dir), -1);
+				StageTurn(player);
+			}
+		}
+		++alive;
+	}
+}
+
+void SnakeCyclesService::OnUpdatePlay()
+{
+	SteerBots();
+
 	std::vector<Wall> newWalls;
 	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
 	{
 		Wall wall;
-		if (mPlayers[i].Move(elapsed, mBoard, kCellColumns, kCellColumns, wall))
+		if (mPlayers[i].Move(mBoard, wall))
 		{
 			newWalls.push_back(wall);
 		}
 	}
+	OnBlocksMoved(newWalls);
+
+	// Check Game End
+
+	++mPlayTick;
+}
+
+void SnakeCyclesService::OnBlocksMoved(const std::vector<Wall>& newWalls)
+{
+	mWalls += static_cast<int>(newWalls.size());
 
 	if (!newWalls.empty())
 	{
-		for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+		ResolveCollisions();
+
+		for (size_t i = 0 ; i < newWalls.size() ; ++i)
 		{
-			mPlayers[i].CheckCollision(mPlayers, mBoard, kCellColumns, kCellColumns);
+			unsigned int cell = static_cast<unsigned int>(mBoard.GetIndex(newWalls[i].pos.x, newWalls[i].pos.y));
+			mBoardHash += cell * 31 + static_cast<unsigned int>(newWalls[i].playerIndex);
 		}
 
-		SendMove(newWalls);
-	}
+		RecordFrame(newWalls);
+		mReplay.Append(mPlayTick, SnakeReplay::Record::kChecksum, 0, GetFrame(mFrame).checksum);
 
-	// Check Game End
+		if (mConfig->lockstep)
+		{
+			SendStep();
+		}
+		else
+		{
+			SendFrame();
+		}
+
+		if (mChannel.IsWatched())
+		{
+			mSpectatorWalls.insert(mSpectatorWalls.end(), newWalls.begin(), newWalls.end());
+		}
+		mChannel.Touch();
+	}
 }
 
-void SnakeCyclesService::OnRecvPlay(Player& player, rapidjson::Document& data)
+void SnakeCyclesService::OnRecvPlay(Player& player, const Input& input)
 {
 	// Input handling
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "snakecycles")
+	if (input.type == Input::kInputDir)
+	{
+		// a direction given too many steps ago is dropped. otherwise it waits for the next block.
+		if (input.frame >= 0 && (input.frame > mFrame || mFrame - input.frame > kMaxLateSteps))
+		{
+			LOG("SnakeCyclesService::OnRecvPlay() - player[%d] direction for step %d is dropped at step %d.", player.GetIndex(), input.frame, mFrame);
+			return;
+		}
+		if (player.QueueTurn(input.dir, input.seq))
+		{
+			StageTurn(player);
+			mReplay.Append(mPlayTick, SnakeReplay::Record::kTurn, player.GetIndex(), static_cast<unsigned int>(input.dir));
+		}
+	}
+	else if (input.type == Input::kInputAck)
+	{
+		player.Ack(input.frame);
+	}
+	else if (input.type == Input::kInputChecksum && mConfig->lockstep)
 	{
-		assert(data["subtype"].IsString());
-		std::string subtype(data["subtype"].GetString());
-		if (subtype == "dir")
+		// checked against the history. the client is past resyncing once the step is out of it.
+		if (input.frame >= 0 && GetFrame(input.frame).number == input.frame && GetFrame(input.frame).checksum != input.checksum)
 		{
-			assert(data["dir"].IsInt());
-			int dir = data["dir"].GetInt();
+			// the steps in flight since the last keyframe mismatch too. they are not answered again.
+			if (player.GetResyncFrame() >= 0 && mFrame - player.GetResyncFrame() < kMinResyncSteps)
+			{
+				return;
+			}
 
-			player.SetDir(static_cast<Direction>(dir));
+			LOG("SnakeCyclesService::OnRecvPlay() - player[%d] is out of sync at step %d. sending a keyframe.", player.GetIndex(), input.frame);
+			SendKeyframe(player);
 		}
 	}
 }
@@ -596,6 +1910,168 @@ void SnakeCyclesService::OnRecvPlay(Player& player, rapidjson::Document& data)
 void SnakeCyclesService::OnLeavePlay(int nNextState)
 {
 	LOG("SnakeCyclesService::OnLeavePlay()");
+
+	mReplay.Append(mPlayTick, SnakeReplay::Record::kEnd, 0, static_cast<unsigned int>(FindWinner()));
+	mReplay.Close();
+
+	if (mInEngine)
+	{
+		LeaveEngine();
+	}
+}
+
+
+void SnakeCyclesService::StartReplay()
+{
+	int number = sReplayCount++;
+	if (number >= sMaxReplays)
+	{
+		if (number == sMaxReplays)
+		{
+			LOG("SnakeCyclesService::StartReplay() - %d replays are written. no more games are recorded.", sMaxReplays);
+		}
+		return;
+	}
+
+	// written on the worker running the room. the records go out in batches.
+	SnakeReplay::Header header;
+	memset(&header, 0, sizeof(header));
+	strncpy(header.mode, mConfig->mode, SnakeReplay::kModeLength);
+	header.rows = static_cast<unsigned short>(mConfig->rows);
+	header.columns = static_cast<unsigned short>(mConfig->columns);
+	header.ticksPerBlock = static_cast<unsigned short>(sTicksPerBlock);
+	header.numPlayers = static_cast<unsigned char>(mPlayers.size());
+	header.lockstep = mConfig->lockstep ? 1 : 0;
+	header.seed = mTick;
+
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		if (mPlayers[i].IsBot())
+		{
+			header.bots |= 1ULL << mPlayers[i].GetIndex();
+		}
+	}
+
+	std::ostringstream path;
+	path << sReplayDirectory << "/snakecycles_" << GetRoomId() << "_" << number << ".rpl";
+	mReplay.Open(path.str(), header);
+}
+
+
+bool SnakeCyclesService::Replay(const SnakeReplay::Header& header, const std::vector<SnakeReplay::Record>& records)
+{
+	// the recorded players by index. the ones who were people play again from their turns.
+	for (int i = 0 ; i < header.numPlayers ; ++i)
+	{
+		mPlayers.push_back(Player(NULL, ((header.bots >> i) & 1) != 0));
+	}
+	mFSM.SetState(kStatePlay);
+
+	for (size_t r = 0 ; r < records.size() ; ++r)
+	{
+		const SnakeReplay::Record& record = records[r];
+
+		// turns and leaves come before their step, a checksum and the end after it.
+		bool afterStep = record.kind == SnakeReplay::Record::kChecksum || record.kind == SnakeReplay::Record::kEnd;
+		while (mFSM.GetState() == kStatePlay && mPlayTick < record.tick + (afterStep ? 1 : 0))
+		{
+			Step();
+		}
+
+		if (mFSM.GetState() != kStatePlay && record.kind != SnakeReplay::Record::kEnd)
+		{
+			ERROR_MSG("SnakeCyclesService::Replay() - the game ended early at step %u.", mPlayTick);
+			return false;
+		}
+
+		PlayerList::iterator itor = std::find_if(mPlayers.begin(), mPlayers.end(), [&record](const Player& player){ return player.GetIndex() == record.player; } );
+
+		switch(record.kind)
+		{
+		case SnakeReplay::Record::kTurn:
+			if (itor != mPlayers.end())
+			{
+				itor->QueueTurn(static_cast<Direction>(record.value & 3), -1);
+			}
+			break;
+
+		case SnakeReplay::Record::kLeave:
+			if (itor != mPlayers.end())
+			{
+				RemovePlayer(itor);
+			}
+			break;
+
+		case SnakeReplay::Record::kChecksum:
+			if (GetFrame(mFrame).checksum != record.value)
+			{
+				ERROR_MSG("SnakeCyclesService::Replay() - checksum mismatch at step %u. %08x, recorded %08x", record.tick, GetFrame(mFrame).checksum, record.value);
+				return false;
+			}
+			break;
+
+		case SnakeReplay::Record::kEnd:
+			// a bot winner has the room waiting again by the end of the same step.
+			if (mFSM.GetState() == kStatePlay || static_cast<unsigned int>(FindWinner()) != record.value)
+			{
+				ERROR_MSG("SnakeCyclesService::Replay() - the game did not end as recorded at step %u.", record.tick);
+				return false;
+			}
+			return true;
+
+		default:
+			ERROR_MSG("SnakeCyclesService::Replay() - unknown record %d.", record.kind);
+			return false;
+		}
+	}
+
+	// cut short, by a server that went down in play.
+	return true;
+}
+
+
+/*static*/ bool SnakeCyclesService::RunReplay(const char* path, int repeat)
+{
+	SnakeReplay::Header header;
+	std::vector<SnakeReplay::Record> records;
+	if (!SnakeReplay::Load(path, header, records))
+	{
+		return false;
+	}
+
+	std::string mode(header.mode, std::find(header.mode, header.mode + SnakeReplay::kModeLength, '\0'));
+	const RoomConfig* config = FindRoomConfig(mode);
+	if (config->rows != header.rows || config->columns != header.columns || header.numPlayers > config->maxPlayers)
+	{
+		ERROR_MSG("SnakeCyclesService::RunReplay() - [%s] does not fit the %s room of this build.", path, config->mode);
+		return false;
+	}
+
+	SetTicksPerBlock(header.ticksPerBlock);
+
+	LOG("SnakeCyclesService::RunReplay() - [%s] %s, %d players, %d records, %d rounds.", path, config->mode, header.numPlayers, records.size(), repeat);
+
+	unsigned long long steps = 0;
+	long long begin = GetPerformanceCounter();
+
+	for (int round = 0 ; round < repeat ; ++round)
+	{
+		SnakeCyclesService* room = new SnakeCyclesService();
+		room->Configure(config);
+
+		bool verified = room->Replay(header, records);
+		steps += room->mPlayTick;
+		delete room;
+
+		if (!verified)
+		{
+			return false;
+		}
+	}
+
+	double seconds = static_cast<double>(GetPerformanceCounter() - begin) / GetPerformanceFrequency();
+	LOG("SnakeCyclesService::RunReplay() - verified. %llu steps in %.3f s, %.2f us/step.", steps, seconds, steps > 0 ? seconds * 1e6 / steps : 0.0);
+	return true;
 }
 
 
@@ -613,21 +2089,17 @@ SnakeCyclesService::PlayerIndex SnakeCyclesService::FindWinner() const
 
 void SnakeCyclesService::SendWinner(PlayerIndex winner) const
 {
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "snakecycles", data.GetAllocator());
-	data.AddMember("subtype", "winner", data.GetAllocator());
-	data.AddMember("winner", static_cast<int>(winner), data.GetAllocator());
-	Broadcast(data);
+	mWriter.Begin("snakecycles", "winner");
+	mWriter.Int("winner", static_cast<int>(winner));
+	mWriter.End();
+	Broadcast(mWriter);
 }
 
 void SnakeCyclesService::SendWait() const
 {
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "snakecycles", data.GetAllocator());
-	data.AddMember("subtype", "wait", data.GetAllocator());
-	Broadcast(data);
+	mWriter.Begin("snakecycles", "wait");
+	mWriter.End();
+	Broadcast(mWriter);
 }
 
 void SnakeCyclesService::OnEnterEnd(int nPrevState)
@@ -636,31 +2108,26 @@ void SnakeCyclesService::OnEnterEnd(int nPrevState)
 
 	mWinner = FindWinner();
 	SendWinner(mWinner);
+	mChannel.Touch();
 }
 
-void SnakeCyclesService::OnUpdateEnd(double elapsed)
+void SnakeCyclesService::OnUpdateEnd()
 {
-	// winner is gone.
-	if (mWinner == kPlayerNone)
+	// winner is gone, or is a bot and will not ask for a restart.
+	auto winner = std::find_if(mPlayers.begin(), mPlayers.end(), [this](const Player& player){ return player.GetIndex() == mWinner; } );
+	if (winner == mPlayers.end() || winner->IsBot())
 	{
 		mFSM.SetState(kStateWait);
 	}
 }
 
-void SnakeCyclesService::OnRecvEnd(Player& player, rapidjson::Document& data)
+void SnakeCyclesService::OnRecvEnd(Player& player, const Input& input)
 {
 	if (player.GetIndex() == mWinner)
 	{
-		assert(data["type"].IsString());
-		std::string type(data["type"].GetString());
-		if (type == "snakecycles")
+		if (input.type == Input::kInputRestart)
 		{
-			assert(data["subtype"].IsString());
-			std::string subtype(data["subtype"].GetString());
-			if (subtype == "restart")
-			{
-				mFSM.SetState(kStateWait);
-			}
+			mFSM.SetState(kStateWait);
 		}
 	}
 }
@@ -671,3 +2138,74 @@ void SnakeCyclesService::OnLeaveEnd(int nNextState)
 	assert(nNextState == kStateWait);
 	SendWait();
 }
+
+
+// Spectators
+void SnakeCyclesService::WriteSnapshot(MessageWriter& writer)
+{
+	writer.Begin("snakecycles", "snapshot");
+	WriteStatus(writer);
+
+	// the board is left over from the last game outside of play.
+	writer.StartArray("walls");
+	if (mFSM.GetState() == kStatePlay || mFSM.GetState() == kStateEnd)
+	{
+		// empty stretches are skipped 64 cells at a time.
+		int columns = mBoard.GetColumns();
+		for (size_t word = 0 ; word < mBoard.GetNumWords() ; ++word)
+		{
+			unsigned long long bits = mBoard.GetWord(word);
+			for (int bit = 0 ; bits != 0 ; ++bit, bits >>= 1)
+			{
+				if (bits & 1)
+				{
+					int index = static_cast<int>(word * 64) + bit;
+					writer.Int(index % columns);
+					writer.Int(index / columns);
+					writer.Int(static_cast<int>(mBoard.GetOwnerAt(index)));
+				}
+			}
+		}
+	}
+	writer.EndArray();
+
+	writer.End();
+}
+
+void SnakeCyclesService::WriteDelta(MessageWriter& writer)
+{
+	writer.Begin("snakecycles", "delta");
+	writer.Int("from_version", mChannel.GetDeltaFrom());
+	WriteStatus(writer);
+
+	writer.StartArray("walls");
+	for (size_t i = 0 ; i < mSpectatorWalls.size() ; ++i)
+	{
+		writer.Int(mSpectatorWalls[i].pos.x);
+		writer.Int(mSpectatorWalls[i].pos.y);
+		writer.Int(static_cast<int>(mSpectatorWalls[i].playerIndex));
+	}
+	writer.EndArray();
+
+	writer.End();
+
+	mSpectatorWalls.clear();
+}
+
+void SnakeCyclesService::WriteStatus(MessageWriter& writer)
+{
+	writer.Int("room", GetRoomId());
+	writer.Int("version", mChannel.GetVersion());
+	writer.Int("state", mFSM.GetState());
+	writer.Int("winner", static_cast<int>(mWinner));
+	writer.String("mode", mConfig->mode);
+	writer.Int("rows", mConfig->rows);
+	writer.Int("columns", mConfig->columns);
+
+	writer.StartArray("players");
+	for (size_t i = 0 ; i < mPlayers.size() ; ++i)
+	{
+		mPlayers[i].WriteStatus(writer);
+	}
+	writer.EndArray();
+}
@@ -1,31 +1,163 @@
 #pragma once
 
 #include <vector>
-#include <rapidjson/document.h>
+#include <string>
+#include <atomic>
 
 #include "FSM.h"
+#include "MessageWriter.h"
+#include "Session.h"
+#include "Matchmaking.h"
+#include "RoomPool.h"
+#include "RoomStats.h"
+#include "ConcurrentQueue.h"
+#include "SpectatorChannel.h"
+#include "SnakeBoard.h"
+#include "SnakeBot.h"
+#include "SnakeReplay.h"
+#include "SnakeMoveEngine.h"
 
 
 class PollingSocket;
+class Message;
 
-class SnakeCyclesService
+class SnakeCyclesService : public Matchmaking::OpenSeatHook, public Matchmaking::JoinCodeHook, public RoomPoolHook
 {
+public:
+	// ServicePack traits.
+	enum
+	{
+		kTicked = true,
+		kCreatesRooms = true,
+		kSession = Session::kServiceSnakeCycles,
+		kSpectated = true,
+	};
+	static const char* GetMessageType() { return "snakecycles"; }
+
 public:
 	static void Init();
 	static void Shutdown();
 
 	static void Update();
-	static void OnRecv(PollingSocket* client, rapidjson::Document& data);
+	static void OnRecv(PollingSocket* client, Message& message);
+
+	// the fixed timestep. a block is moved every ticksPerBlock ticks.
+	static void SetTickRate(int ticksPerSecond);
+	static void SetTicksPerBlock(int ticksPerBlock);
+	static int GetTickRate() { return sTickRate; }
+
+	// the players of every room in play move in one SnakeMoveEngine pass per tick, and the
+	// rooms handle only the ticks their players moved on. set before Init().
+	static void SetBatchMovement(bool batch) { sBatchMovement = batch; }
+
+	// every game is written to a replay file in directory, up to maxFiles of them for the run.
+	// an operator setting. set before Init().
+	static void SetRecordReplays(const char* directory, int maxFiles);
 
 	static void RemoveClient(PollingSocket* client);
+	static void ListRooms(PollingSocket* client, Message& message);
+	static void CollectStats(RoomStatsReport::EntryList& entries);
+	const RoomStats& GetStats() const { return mStats; }
+
+	static void Spectate(PollingSocket* client, Message& message);
+
+	// plays a recorded game again as fast as it runs, repeat times, and checks every
+	// checksum in it. the time taken is logged, which makes it a benchmark of the tick too.
+	static bool RunReplay(const char* path, int repeat);
 
 private:
-	static void CreateOrEnter(PollingSocket* client, rapidjson::Document& data);
+	static bool CreateOrEnter(PollingSocket* client, Message& message);
 	static void Flush();
+	static int TakeDueTicks();
 
 private:
-	typedef std::vector<SnakeCyclesService*> ServiceList;
-	static ServiceList sServices;
+	friend class RoomPool<SnakeCyclesService>;
+	friend class Matchmaking::RoomListing;
+	friend struct Matchmaking::JoinResolver<SnakeCyclesService>;
+
+	typedef RoomPool<SnakeCyclesService> ServicePool;
+	static Matchmaking::OpenSeats<SnakeCyclesService> sOpenSeats;
+	static Matchmaking::JoinCodes<SnakeCyclesService> sJoinCodes;
+	static Matchmaking::RoomListing sListing;	// rebuilt in Update() only, when no room is ticking.
+	static ServicePool sServices;
+
+	// the room types. service_create picks one with "mode", classic by default.
+	struct RoomConfig
+	{
+		const char* mode;
+		int rows;
+		int columns;
+		int minPlayers;
+		int maxPlayers;
+		bool lockstep;		// the clients are sent the inputs of each step and run the board themselves.
+	};
+	static const RoomConfig sRoomConfigs[];
+	static const RoomConfig* FindRoomConfig(const std::string& mode);
+
+	// queued by the I/O thread while the rooms run on the TaskPool. applied in Update().
+	struct PendingJoin
+	{
+		PollingSocket* client;
+		Matchmaking::JoinRequest request;
+		const RoomConfig* config;
+		int bots;		// seats filled with bots right after the client, when it gets a new room.
+	};
+	struct PendingLeave
+	{
+		SnakeCyclesService* service;
+		PollingSocket* client;
+	};
+	static std::vector<PendingJoin> sPendingJoins;
+	static std::vector<PendingLeave> sPendingLeaves;
+	static void ApplyLeaves();
+
+	// a room takes the least loaded phase slot of the block period when it is acquired.
+	// its timers are lined up with the slot, so rooms filled together still move apart.
+	enum
+	{
+		kPhaseSlots = 16,
+	};
+	static void AssignPhaseSlot(SnakeCyclesService* service);
+	static void ReleasePhaseSlot(SnakeCyclesService* service);
+	static void ReportSlotLoad();
+
+	enum
+	{
+		kDefaultTickRate = 20,
+		kDefaultTicksPerBlock = 20,
+		kMaxTicksPerBatch = 8,		// behind by more, the rest is dropped.
+	};
+	static int sTickRate;
+	static int sTicksPerBlock;
+	static unsigned int sTick;					// the next tick to run. rooms count from it, not from the clock.
+	static long long sTickAccumulator;			// performance counter units not ticked yet.
+	static long long sLastTickTime;
+
+	static std::string sReplayDirectory;		// empty when no game is recorded.
+	static int sMaxReplays;
+	static std::atomic<int> sReplayCount;		// numbers the replay files. rooms start games on any worker.
+
+	// batch movement. a shard is a share of the rooms with its own engine, run as one task.
+	struct Shard
+	{
+		SnakeMoveEngine engine;
+		std::vector<SnakeCyclesService*> rooms;
+
+		// rebuilt every batch.
+		std::vector<SnakeCyclesService*> stepped;	// not in the engine. they step every tick as usual.
+		std::vector<SnakeCyclesService*> steered;	// in play with bots, who look at the board before each block.
+		std::vector<SnakeCyclesService*> moved;
+	};
+	static void AssignShard(SnakeCyclesService* service);
+	static void ReleaseShard(SnakeCyclesService* service);
+	static void UpdateShard(Shard* shard, unsigned int firstTick, int numTicks);
+
+	static bool sBatchMovement;
+	static std::vector<Shard> sShards;
+
+	static int sSlotRooms[kPhaseSlots];
+	static int sSlotWalls[kPhaseSlots];	// walls moved since the last report.
+	static unsigned int sLastSlotReport;
 
 private:
 	enum State
@@ -36,14 +168,12 @@ private:
 		kStateEnd,
 	};
 
-	enum PlayerIndex
-	{
-		kPlayer1 = 0,
-		kPlayer2,
-		kPlayer3,
-		kPlayer4,
+	// the board keeps a byte per cell for the owner of a wall, which covers the largest room.
+	typedef int PlayerIndex;
 
-		kPlayerNone,
+	enum
+	{
+		kPlayerNone = 0xFF,
 	};
 
 	enum Direction
@@ -54,30 +184,57 @@ private:
 		kRIGHT,
 	};
 
-	enum
+	struct Position
 	{
-		kMinPlayers = 1, //2,
-		kMaxPlayers = 4,
+		Position() : x(0), y(0) {}
+
+		int x;
+		int y;
 	};
 
-	enum CellCount
+	struct Wall
 	{
-		kCellRows = 20,
-		kCellColumns = 20,
+		Position pos;
+		PlayerIndex playerIndex;
 	};
 
-	struct Position
+	// a message decoded on the I/O thread and handed to the room's tick.
+	struct Input
 	{
-		Position() : x(0), y(0) {}
+		enum Type
+		{
+			kInputDir,
+			kInputRestart,
+			kInputAck,
+			kInputChecksum,
+		};
+
+		Input() : client(NULL), slot(-1), type(kInputDir), dir(kUP), frame(-1), checksum(0), seq(-1) {}
+
+		PollingSocket* client;
+		int slot;
+		Type type;
+		Direction dir;
+		int frame;		// acked or checked. for a direction, the step it was given after.
+		unsigned int checksum;
+		int seq;		// the client's count of its directions. a repeat is dropped.
+	};
+
+	// what the clients see of a player. kept per frame, to diff against what a client acked.
+	struct PlayerStatus
+	{
+		PlayerStatus() : x(0), y(0), dir(kUP), state(0) {}
 
 		int x;
 		int y;
+		int dir;
+		int state;
 	};
 
-	struct Wall
+	enum
 	{
-		Position pos;
-		PlayerIndex playerIndex;
+		kMaxInputs = 64,
+		kMaxQueuedTurns = 4,
 	};
 
 	class Player
@@ -90,16 +247,43 @@ private:
 		};
 
 	public:
-		Player(PollingSocket* client);
+		Player(PollingSocket* client, bool bot);
 
 	public:
-		void Init(PlayerIndex index, PlayerIndex* board, int numRows, int numCols);
-		bool Move(double elapsed, PlayerIndex* board, int numRows, int numCols, Wall& wall);
-		void CheckCollision(const std::vector<Player>& players, PlayerIndex* board, int numRows, int numCols);
+		void Init(PlayerIndex index, int numPlayers, int numRows, int numCols);
+		bool Move(SnakeBoard& board, Wall& wall);
+		void CheckCollision(const SnakeBoard& board, bool headOn);
+
+		void WriteStatus(MessageWriter& writer) const;
+		void WriteChanges(MessageWriter& writer, const PlayerStatus& base) const;
 
-		void GetStatus(rapidjson::Value& outData, rapidjson::Document::AllocatorType& allocator) const;
+		PlayerStatus GetStatus() const;
+		bool HasChanged(const PlayerStatus& base) const;
+
+		// frames sent to the client and acked by it. play is frame 0 and counts as acked.
+		void ResetFrames() { mAckedFrame = 0; mSentFrame = 0; mResyncFrame = -1; }
+		void Ack(int frame);
+		void SetSentFrame(int frame) { mSentFrame = frame; }
+		int GetAckedFrame() const { return mAckedFrame; }
+		int GetSentFrame() const { return mSentFrame; }
+
+		// the last lockstep step it was resynced on. -1 when it has not been.
+		void SetResyncFrame(int frame) { mResyncFrame = frame; }
+		int GetResyncFrame() const { return mResyncFrame; }
 
 		PollingSocket* GetClient() const { return mClient; }
+		bool IsBot() const { return mBot; }
+		bool IsMovingNext() const { return mTicksRemaining <= 1; }
+		int GetTicksRemaining() const { return mTicksRemaining; }
+		void SetTicksRemaining(int ticks) { mTicksRemaining = ticks; }
+		Direction GetDir() const { return mDirection; }
+		Direction GetNextDir() const { return mNumTurns > 0 ? mTurns[mFirstTurn] : mDirection; }
+
+		// batch movement. the engine moved the head to pos.
+		void MoveTo(SnakeBoard& board, Wall& wall, const Position& pos);
+
+		void SetSlot(int slot) { mSlot = slot; }
+		int GetSlot() const { return mSlot; }
 
 		void SetName(const char* name) { mName = name; }
 		const char* GetName() const { return mName.c_str(); }
@@ -110,77 +294,210 @@ private:
 		void SetIndex(PlayerIndex index) { mIndex = index; }
 		PlayerIndex GetIndex() const { return mIndex; }
 
-		void SetDir(Direction dir) { mDirection = dir; }
+		// turns are queued and taken one per block, in the order they were given.
+		bool QueueTurn(Direction dir, int seq);
+		const Position& GetPos() const { return mPos; }
+
+	private:
+		void TakeTurn();
 
 	private:
-		PollingSocket* mClient;
+		PollingSocket* mClient;		// NULL for a bot, or a player in a replay.
+		bool mBot;
 		std::string mName;
 		State mState;
 		PlayerIndex mIndex;
-		double mTimeRemaing;
+		int mTicksRemaining;
 		Direction mDirection;
 		Position mPos;
+
+		Direction mTurns[kMaxQueuedTurns];
+		int mFirstTurn;
+		int mNumTurns;
+		int mLastSeq;
+
+		int mAckedFrame;
+		int mSentFrame;
+		int mResyncFrame;
+
+		int mSlot;		// in the room's engine while in play with batch movement. -1 otherwise.
+	};
+	typedef std::vector<Player> PlayerList;
+
+	// a frame is a tick that moved walls. clients are sent what changed since the frame they
+	// acked, from the history, or a keyframe of the whole board once that is out of it.
+	struct Frame
+	{
+		Frame() : number(-1), checksum(0) {}
+
+		int number;
+		std::vector<Wall> walls;
+		std::vector<PlayerStatus> players;	// by player index.
+		unsigned int checksum;				// of the state after it. see ComputeChecksum().
+	};
+
+	enum
+	{
+		kHistoryFrames = 32,
+		kKeyframeInterval = 256,	// frames. a keyframe is also sent every so often, staggered by seat.
+		kMaxUnackedFrames = 8,		// behind by more, a client is sent nothing until it acks.
+		kMaxLateSteps = 2,			// a direction given more steps ago than this is dropped.
+		kMinResyncSteps = 16,		// a client out of sync is sent a keyframe at most once in this many steps.
 	};
 
 private:
 	SnakeCyclesService(void);
 	~SnakeCyclesService(void);
 
-	void UpdateInternal();
-	void OnRecvInternal(PollingSocket* client, rapidjson::Document& data);
+	static bool ReadInput(Message& message, Input& input);
+
+	// the heads of a tick, hashed by cell. sized for the room, so it is cleared in O(players).
+	struct HeadSlot
+	{
+		HeadSlot() : cell(-1), count(0) {}
 
-	void OnRecvWait(Player& player, rapidjson::Document& data);
-	void OnRecvCountdown(Player& player, rapidjson::Document& data);
-	void OnRecvPlay(Player& player, rapidjson::Document& data);
-	void OnRecvEnd(Player& player, rapidjson::Document& data);
+		int cell;
+		int count;
+	};
 
+	void UpdateInternal(unsigned int firstTick, int numTicks);
+	void Step();
+
+	void BeginBatch(unsigned int firstTick);
+	void StepAt(unsigned int tick);
+	void OnEngineMoved(unsigned int tick);
+	void EnterEngine();
+	void LeaveEngine();
+	void StageTurn(const Player& player);
+	bool IsMovingNext(const Player& player) const;
+	bool HasBots() const;
+	SnakeMoveEngine& GetEngine() const { return sShards[mShard].engine; }
+	void PushInput(const Input& input);
+	void OnRecvInternal(const Input& input);
+
+	void OnRecvWait(Player& player, const Input& input);
+	void OnRecvCountdown(Player& player, const Input& input);
+	void OnRecvPlay(Player& player, const Input& input);
+	void OnRecvEnd(Player& player, const Input& input);
+
+	void Configure(const RoomConfig* config);
+	void ResolveCollisions();
+	HeadSlot& FindHead(int cell);
 	void AddClient(PollingSocket* client);
+	void AddBots(int count);
+	bool HasHumans() const;
+	void SteerBots();
+	void OnBlocksMoved(const std::vector<Wall>& newWalls);
 	bool RemoveClientInternal(PollingSocket* client);
+	void RemovePlayer(PlayerList::iterator itor);
+
+	void StartReplay();
+	bool Replay(const SnakeReplay::Header& header, const std::vector<SnakeReplay::Record>& records);
 
 	void InitFSM();
 	void ShutdownFSM();
 
 	void OnEnterWait(int nPrevState);
-	void OnUpdateWait(double elapsed);
+	void OnUpdateWait();
 	void OnLeaveWait(int nNextState);
 
 	void OnEnterCountdown(int nPrevState);
-	void OnUpdateCountdown(double elapsed);
+	void OnUpdateCountdown();
 	void OnLeaveCountdown(int nNextState);
 
 	void OnEnterPlay(int nPrevState);
-	void OnUpdatePlay(double elapsed);
+	void OnUpdatePlay();
 	void OnLeavePlay(int nNextState);
 
 	void OnEnterEnd(int nPrevState);
-	void OnUpdateEnd(double elapsed);
+	void OnUpdateEnd();
 	void OnLeaveEnd(int nNextState);
 
+	void DummyUpdate(double) {}
+
+	void SyncSeat();
+	void OpenSeat();
+	bool HasOpenSeat();
+
+	bool IsListed() { return !IsPrivate() && HasOpenSeat(); }
+	void WriteListEntry(MessageWriter& writer);
+	int GetPhaseDelay() const;
 	void CheckPlayerConnection();
 
-	void SetPlayerName(Player& player, rapidjson::Document& data);
+	void SetPlayerName(Player& player, Message& message);
 
-	void Send(PollingSocket* client, rapidjson::Document& data) const;
-	void Broadcast(rapidjson::Document& data) const;
+	void Send(PollingSocket* client, const MessageWriter& writer) const;
+	void Broadcast(const MessageWriter& writer) const;
 
 	void SendCountdown() const;
 	void SendPlayerIndex(const Player& player) const;
 	void SendPlay() const;
-	void SendMove(const std::vector<Wall>& newWalls) const;
+	void RecordFrame(const std::vector<Wall>& newWalls);
+	void SendFrame();
+	void WriteKeyframe(MessageWriter& writer) const;
+	void WriteFrameDelta(MessageWriter& writer, int base) const;
+	void SendStep();
+	void SendKeyframe(Player& player);
+	unsigned int ComputeChecksum() const;
+	const Frame& GetFrame(int number) const { return mHistory[number % (kHistoryFrames + 1)]; }
 	PlayerIndex FindWinner() const;
 	void SendWinner(PlayerIndex winner) const;
 	void SendWait() const;
 
+	void WriteSnapshot(MessageWriter& writer);
+	void WriteDelta(MessageWriter& writer);
+	void WriteStatus(MessageWriter& writer);
+
 private:
-	typedef std::vector<Player> PlayerList;
 	PlayerList mPlayers;
 
-	PlayerIndex mBoard[kCellRows*kCellColumns];
+	const RoomConfig* mConfig;
+	SnakeBoard mBoard;
+	std::vector<HeadSlot> mHeads;
+	int mHeadShift;
+
+	SnakeReplay::Writer mReplay;	// open while a recorded game is played.
+	unsigned int mPlayTick;			// play steps run in the game. the replays count in these.
+	unsigned int mPlayStartTick;
+
+	int mShard;
+	bool mInEngine;
+	unsigned int mEngineTick;		// the last tick the engine moved one of the players on.
+
+	SnakeBot mBot;		// shared by the room's bots, one decision at a time.
+	std::vector<SnakeBot::Head> mBotHeads;
 
 	FSM mFSM;
 
-	double mCoutdownRemaing;
+	unsigned int mTick;		// the tick being run.
+	int mCountdownTicks;
 	int mCountdownSent;
 
 	PlayerIndex mWinner;
+
+	int mFrame;			// the last frame recorded. play is 0.
+	Frame mHistory[kHistoryFrames + 1];
+	MessageWriter mKeyframe;	// built once per frame, for every client that needs it.
+	int mKeyframeNumber;
+
+	unsigned int mBoardHash;				// the walls' part of the checksum, summed as they are built.
+	std::vector<PlayerIndex> mLeftPlayers;	// lockstep. left since the last step.
+
+	int mPhaseSlot;
+	int mWalls;		// moved on the worker, collected by ReportSlotLoad() between ticks.
+
+	// pushed by the I/O thread, drained by the tick on a worker.
+	SpscQueue<Input> mInputs;
+
+	// shared by every message the room builds. const senders write into it too.
+	mutable MessageWriter mWriter;
+
+	// the matchmaking bucket the room was opened for.
+	std::string mBucket;
+
+	// written by the tick on a worker. read by CollectStats() between ticks.
+	mutable RoomStats mStats;
+
+	SpectatorChannel mChannel;
+	std::vector<Wall> mSpectatorWalls;	// since the last delta. kept only while watched.
 };
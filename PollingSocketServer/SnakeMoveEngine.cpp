@@ -0,0 +1,116 @@
+#include "SnakeMoveEngine.h"
+
+#include <cassert>
+#include <emmintrin.h>
+
+
+SnakeMoveEngine::SnakeMoveEngine()
+{
+}
+
+
+int SnakeMoveEngine::Add(void* owner, int x, int y, int dx, int dy, int ticks)
+{
+	if (mFree.empty())
+	{
+		// a whole group at a time. the lowest lane is taken first.
+		size_t size = mX.size();
+		size_t grown = size + kLanes;
+
+		mX.resize(grown, 0);
+		mY.resize(grown, 0);
+		mDX.resize(grown, 0);
+		mDY.resize(grown, 0);
+		mTicks.resize(grown, 0);
+		mActive.resize(grown, 0);
+		mOwners.resize(grown, NULL);
+
+		for (size_t lane = grown ; lane > size ; --lane)
+		{
+			mFree.push_back(static_cast<int>(lane - 1));
+		}
+	}
+
+	int slot = mFree.back();
+	mFree.pop_back();
+
+	mX[slot] = x;
+	mY[slot] = y;
+	mDX[slot] = dx;
+	mDY[slot] = dy;
+	mTicks[slot] = ticks;
+	mActive[slot] = -1;
+	mOwners[slot] = owner;
+	return slot;
+}
+
+
+void SnakeMoveEngine::Remove(int slot)
+{
+	assert(slot >= 0 && slot < static_cast<int>(mX.size()) && mOwners[slot] != NULL);
+
+	mActive[slot] = 0;
+	mOwners[slot] = NULL;
+	mFree.push_back(slot);
+}
+
+
+void SnakeMoveEngine::Step(int period)
+{
+	mMoved.clear();
+
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i restart = _mm_set1_epi32(period);
+
+	int size = static_cast<int>(mX.size());
+	for (int lane = 0 ; lane < size ; lane += kLanes)
+	{
+		__m128i active = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mActive[lane]));
+		if (_mm_movemask_epi8(active) == 0)
+		{
+			continue;
+		}
+
+		// ticks - 1 where active. moved where that reaches zero.
+		__m128i ticks = _mm_add_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&mTicks[lane])), active);
+		__m128i moved = _mm_and_si128(active, _mm_cmpgt_epi32(one, ticks));
+		ticks = _mm_or_si128(_mm_and_si128(moved, restart), _mm_andnot_si128(moved, ticks));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&mTicks[lane]), ticks);
+
+		int mask = _mm_movemask_ps(_mm_castsi128_ps(moved));
+		if (mask == 0)
+		{
+			continue;
+		}
+
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mX[lane]));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mY[lane]));
+		__m128i dx = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mDX[lane]));
+		__m128i dy = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mDY[lane]));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&mX[lane]), _mm_add_epi32(x, _mm_and_si128(moved, dx)));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&mY[lane]), _mm_add_epi32(y, _mm_and_si128(moved, dy)));
+
+		for (int i = 0 ; i < kLanes ; ++i)
+		{
+			if (mask & (1 << i))
+			{
+				mMoved.push_back(lane + i);
+			}
+		}
+	}
+}
+
+
+void SnakeMoveEngine::Clear()
+{
+	mX.clear();
+	mY.clear();
+	mDX.clear();
+	mDY.clear();
+	mTicks.clear();
+	mActive.clear();
+	mOwners.clear();
+	mFree.clear();
+	mMoved.clear();
+}
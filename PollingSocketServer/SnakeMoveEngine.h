@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+// The moving part of the SnakeCycles tick for many rooms at once, as a struct of arrays.
+// A slot is one player's head : where it is, the step it takes next and the ticks until it
+// does. Step() counts every active slot down and moves the ones that reach zero, four slots
+// to an SSE2 instruction, and lists the slots that moved. The rooms look at those only.
+// Slots are dealt out four at a time and reused, so a room's players need not be together.
+class SnakeMoveEngine
+{
+public:
+	SnakeMoveEngine();
+
+	int Add(void* owner, int x, int y, int dx, int dy, int ticks);
+	void Remove(int slot);
+
+	void SetStep(int slot, int dx, int dy) { mDX[slot] = dx; mDY[slot] = dy; }
+	void SetActive(int slot, bool active) { mActive[slot] = active ? -1 : 0; }
+
+	int GetX(int slot) const { return mX[slot]; }
+	int GetY(int slot) const { return mY[slot]; }
+	int GetTicks(int slot) const { return mTicks[slot]; }
+	void* GetOwner(int slot) const { return mOwners[slot]; }
+
+	// one tick. a slot that moves starts counting again from period.
+	void Step(int period);
+	const std::vector<int>& GetMoved() const { return mMoved; }
+
+	void Clear();
+
+private:
+	enum
+	{
+		kLanes = 4,
+	};
+
+	// the lanes, padded to whole groups of kLanes. a free lane is inactive.
+	std::vector<int> mX;
+	std::vector<int> mY;
+	std::vector<int> mDX;
+	std::vector<int> mDY;
+	std::vector<int> mTicks;
+	std::vector<int> mActive;	// -1 or 0, so it masks the lane.
+	std::vector<void*> mOwners;
+
+	std::vector<int> mFree;
+	std::vector<int> mMoved;
+};
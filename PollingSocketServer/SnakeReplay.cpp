@@ -0,0 +1,125 @@
+#include "SnakeReplay.h"
+
+#include <cstring>
+
+#include "Log.h"
+
+#pragma warning(disable:4996) //4996: 'fopen': This function or variable may be unsafe. Consider using fopen_s instead.
+
+namespace
+{
+	const char kMagic[4] = { 'S', 'C', 'R', 'P' };
+}
+
+namespace SnakeReplay
+{
+	Writer::Writer()
+		: mFile(NULL)
+		, mNumRecords(0)
+	{
+	}
+
+	Writer::~Writer()
+	{
+		Close();
+	}
+
+	bool Writer::Open(const std::string& path, const Header& header)
+	{
+		Close();
+
+		mFile = fopen(path.c_str(), "wb");
+		if (mFile == NULL)
+		{
+			ERROR_MSG("SnakeReplay::Writer::Open() - failed to open [%s]", path.c_str());
+			return false;
+		}
+
+		Header stamped = header;
+		memcpy(stamped.magic, kMagic, sizeof(kMagic));
+		stamped.version = kVersion;
+		fwrite(&stamped, sizeof(stamped), 1, mFile);
+
+		mBatch.reserve(kBatchRecords);
+		mNumRecords = 0;
+		return true;
+	}
+
+	void Writer::Close()
+	{
+		if (mFile)
+		{
+			Flush();
+			fclose(mFile);
+			mFile = NULL;
+		}
+	}
+
+	void Writer::Append(unsigned int tick, Record::Kind kind, int player, unsigned int value)
+	{
+		if (mFile == NULL)
+		{
+			return;
+		}
+
+		if (++mNumRecords > kMaxRecords)
+		{
+			LOG("SnakeReplay::Writer::Append() - %d records are written. the rest of the game is not.", kMaxRecords);
+			Close();
+			return;
+		}
+
+		Record record;
+		record.tick = tick;
+		record.kind = static_cast<unsigned char>(kind);
+		record.player = static_cast<unsigned char>(player);
+		record.reserved = 0;
+		record.value = value;
+		mBatch.push_back(record);
+
+		if (mBatch.size() >= kBatchRecords)
+		{
+			Flush();
+		}
+	}
+
+	void Writer::Flush()
+	{
+		if (!mBatch.empty())
+		{
+			fwrite(&mBatch[0], sizeof(Record), mBatch.size(), mFile);
+			mBatch.clear();
+		}
+	}
+
+
+	bool Load(const char* path, Header& header, std::vector<Record>& records)
+	{
+		FILE* file = fopen(path, "rb");
+		if (file == NULL)
+		{
+			ERROR_MSG("SnakeReplay::Load() - failed to open [%s]", path);
+			return false;
+		}
+
+		bool loaded = fread(&header, sizeof(header), 1, file) == 1
+			&& memcmp(header.magic, kMagic, sizeof(kMagic)) == 0
+			&& header.version == kVersion;
+
+		if (loaded)
+		{
+			Record record;
+			while (fread(&record, sizeof(record), 1, file) == 1)
+			{
+				records.push_back(record);
+			}
+		}
+		else
+		{
+			ERROR_MSG("SnakeReplay::Load() - [%s] is not a replay of version %d", path, kVersion);
+		}
+
+		fclose(file);
+		return loaded;
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// The binary log of one SnakeCycles game, enough to play it again offline.
+// A Header and then Records to the end of the file, all fixed size and little endian with
+// no pointers or padding to fix up, so a file can be mapped and read as an array in place.
+// The records are in the order the room saw them. ticks count the play steps from 0, so a
+// replay does not depend on the clock or on ticks dropped when the server fell behind.
+namespace SnakeReplay
+{
+	enum
+	{
+		kVersion = 1,
+		kModeLength = 16,
+	};
+
+	struct Header
+	{
+		char magic[4];				// "SCRP"
+		unsigned int version;
+		char mode[kModeLength];		// the room type, '\0' padded.
+		unsigned short rows;
+		unsigned short columns;
+		unsigned short ticksPerBlock;
+		unsigned char numPlayers;
+		unsigned char lockstep;
+		unsigned int seed;			// the tick the game started on. the engine draws no random numbers.
+		unsigned int reserved;
+		unsigned long long bots;	// bit i is set when player i is a bot.
+	};
+
+	struct Record
+	{
+		enum Kind
+		{
+			kTurn,			// value : the direction queued. before the step.
+			kLeave,			// before the step.
+			kChecksum,		// value : the state after the step. see SnakeCyclesService::ComputeChecksum().
+			kEnd,			// value : the winner, 255 for none.
+		};
+
+		unsigned int tick;
+		unsigned char kind;
+		unsigned char player;
+		unsigned short reserved;
+		unsigned int value;
+	};
+
+	// appends the records of a game in batches of kBatchRecords, up to kMaxRecords.
+	// a game that runs longer is cut there, so one file stays under 12 MB.
+	class Writer
+	{
+	public:
+		enum
+		{
+			kBatchRecords = 1024,
+			kMaxRecords = 1024 * 1024,
+		};
+
+	public:
+		Writer();
+		~Writer();
+
+		bool Open(const std::string& path, const Header& header);
+		void Close();
+		bool IsOpen() const { return mFile != NULL; }
+
+		void Append(unsigned int tick, Record::Kind kind, int player, unsigned int value);
+
+	private:
+		Writer(const Writer&);
+		Writer& operator=(const Writer&);
+
+		void Flush();
+
+	private:
+		FILE* mFile;
+		std::vector<Record> mBatch;
+		int mNumRecords;
+	};
+
+	bool Load(const char* path, Header& header, std::vector<Record>& records);
+}
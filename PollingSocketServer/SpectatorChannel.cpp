@@ -0,0 +1,220 @@
+#include "SpectatorChannel.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "PollingSocket.h"
+#include "RoomStats.h"
+#include "Log.h"
+
+/*static*/ unsigned int SpectatorChannel::sDeltaInterval = SpectatorChannel::kDefaultDeltaInterval;
+/*static*/ std::vector<SpectatorChannel*> SpectatorChannel::sDirty;
+
+/*static*/ void SpectatorChannel::Unsubscribe(PollingSocket* socket)
+{
+	Session& session = socket->GetSession();
+	if (session.channel)
+	{
+		session.channel->Remove(socket, session.channelSlot);
+	}
+}
+
+/*static*/ void SpectatorChannel::FlushDirty()
+{
+	for (size_t i = sDirty.size() ; i > 0 ; --i)
+	{
+		SpectatorChannel* channel = sDirty[i - 1];
+		channel->Flush();
+
+		// a delta held back by the interval keeps it on the list.
+		if (!channel->HasWork())
+		{
+			channel->mDirty = false;
+			sDirty[i - 1] = sDirty.back();
+			sDirty.pop_back();
+		}
+	}
+}
+
+
+SpectatorChannel::SpectatorChannel()
+	: mStats(NULL)
+	, mSnapshotVersion(-1)
+	, mVersion(0)
+	, mDeltaFrom(0)
+	, mDeltaPending(false)
+	, mResetPending(false)
+	, mLastDelta(0)
+	, mWatched(false)
+	, mDirty(false)
+{
+}
+
+
+SpectatorChannel::~SpectatorChannel()
+{
+	// the sockets may be gone already at shutdown. only the dirty list is cleaned.
+	if (mDirty)
+	{
+		sDirty.erase(std::find(sDirty.begin(), sDirty.end(), this));
+	}
+}
+
+
+void SpectatorChannel::Init(const WriteFunc& writeSnapshot, const WriteFunc& writeDelta, RoomStats* stats)
+{
+	mWriteSnapshot = writeSnapshot;
+	mWriteDelta = writeDelta;
+	mStats = stats;
+}
+
+
+void SpectatorChannel::Subscribe(PollingSocket* socket)
+{
+	Session& session = socket->GetSession();
+	assert(session.channel == NULL);
+
+	session.channel = this;
+	session.channelSlot = -1;
+	mJoining.push_back(socket);
+}
+
+
+void SpectatorChannel::Close()
+{
+	MessageWriter writer;
+	writer.Begin("spectate", "closed");
+	writer.End();
+
+	Send(writer, mSpectators);
+	Send(writer, mJoining);
+
+	for (size_t i = 0 ; i < mSpectators.size() ; ++i)
+	{
+		mSpectators[i]->GetSession().Unwatch();
+	}
+	for (size_t i = 0 ; i < mJoining.size() ; ++i)
+	{
+		mJoining[i]->GetSession().Unwatch();
+	}
+	mSpectators.clear();
+	mJoining.clear();
+
+	mDeltaPending = false;
+	mResetPending = false;
+	mDeltaFrom = mVersion;
+	mWatched = false;
+}
+
+
+void SpectatorChannel::Flush()
+{
+	if (mResetPending)
+	{
+		// everyone starts over.
+		mJoining.insert(mJoining.end(), mSpectators.begin(), mSpectators.end());
+		mSpectators.clear();
+
+		mResetPending = false;
+		mDeltaPending = false;
+		mDeltaFrom = mVersion;
+	}
+
+	if (!mJoining.empty())
+	{
+		SendSnapshot(mJoining);
+
+		for (size_t i = 0 ; i < mJoining.size() ; ++i)
+		{
+			mJoining[i]->GetSession().channelSlot = static_cast<int>(mSpectators.size());
+			mSpectators.push_back(mJoining[i]);
+		}
+		mJoining.clear();
+	}
+
+	if (mDeltaPending)
+	{
+		unsigned int now = GetTickCount();
+
+		if (mSpectators.empty())
+		{
+			// nobody to tell. the next spectator starts from a snapshot anyway.
+			mDeltaPending = false;
+			mDeltaFrom = mVersion;
+		}
+		else if (now - mLastDelta >= sDeltaInterval)
+		{
+			mWriteDelta(mDelta);
+			Send(mDelta, mSpectators);
+
+			mDeltaPending = false;
+			mDeltaFrom = mVersion;
+			mLastDelta = now;
+		}
+	}
+
+	mWatched = !mSpectators.empty();
+}
+
+
+void SpectatorChannel::MarkDirty()
+{
+	if (!mDirty)
+	{
+		mDirty = true;
+		sDirty.push_back(this);
+	}
+}
+
+
+void SpectatorChannel::SendSnapshot(const std::vector<PollingSocket*>& sockets)
+{
+	if (mSnapshotVersion != mVersion)
+	{
+		mWriteSnapshot(mSnapshot);
+		mSnapshotVersion = mVersion;
+	}
+
+	Send(mSnapshot, sockets);
+}
+
+
+void SpectatorChannel::Send(const MessageWriter& writer, const std::vector<PollingSocket*>& sockets)
+{
+	for (size_t i = 0 ; i < sockets.size() ; ++i)
+	{
+		sockets[i]->AsyncSend(writer.GetData(), writer.GetSize());
+
+		// flushed while the room is not running, so its stats hold still.
+		if (mStats)
+		{
+			mStats->OnSend(writer.GetSize());
+		}
+	}
+}
+
+
+void SpectatorChannel::Remove(PollingSocket* socket, int slot)
+{
+	if (slot < 0)
+	{
+		mJoining.erase(std::find(mJoining.begin(), mJoining.end(), socket));
+	}
+	else
+	{
+		assert(slot < static_cast<int>(mSpectators.size()) && mSpectators[slot] == socket);
+
+		PollingSocket* last = mSpectators.back();
+		mSpectators[slot] = last;
+		last->GetSession().channelSlot = slot;
+		mSpectators.pop_back();
+	}
+
+	socket->GetSession().Unwatch();
+}
+
+
+bool SpectatorChannel::HasWork() const
+{
+	return mResetPending || mDeltaPending || !mJoining.empty();
+}
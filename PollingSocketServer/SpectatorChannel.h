@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <boost/function.hpp>
+
+#include "MessageWriter.h"
+
+class PollingSocket;
+struct RoomStats;
+
+// The spectators of a room.
+// A joining spectator gets the cached full snapshot, which is rebuilt only when the room's
+// version moved since it was last written. After that the spectators get deltas at most
+// once per delta interval. Each frame is serialized once and the same bytes go to everyone.
+//
+// The spectator lists live on the I/O thread. A room ticking on the TaskPool only calls
+// Touch() / Reset() and reads IsWatched(). Flush() runs while the room is not ticking.
+class SpectatorChannel
+{
+public:
+	typedef boost::function<void (MessageWriter& writer)> WriteFunc;
+
+	enum
+	{
+		kDefaultDeltaInterval = 250,	// milliseconds
+	};
+
+	static void SetDeltaInterval(unsigned int milliseconds) { sDeltaInterval = milliseconds; }
+	static unsigned int GetDeltaInterval() { return sDeltaInterval; }
+
+	// stops the connection watching, if it does.
+	static void Unsubscribe(PollingSocket* socket);
+
+	// flushes the channels marked with MarkDirty(). for rooms on the I/O thread.
+	static void FlushDirty();
+
+public:
+	SpectatorChannel();
+	~SpectatorChannel();
+
+	// what goes out is counted in the room's stats.
+	void Init(const WriteFunc& writeSnapshot, const WriteFunc& writeDelta, RoomStats* stats);
+
+	void Subscribe(PollingSocket* socket);
+	void Close();
+
+	// the room changed. a delta is due.
+	void Touch() { ++mVersion; mDeltaPending = true; }
+	// the room started over. everyone gets a new snapshot.
+	void Reset() { ++mVersion; mResetPending = true; }
+
+	int GetVersion() const { return mVersion; }
+	int GetDeltaFrom() const { return mDeltaFrom; }
+	bool IsWatched() const { return mWatched; }
+
+	void Flush();
+	void MarkDirty();
+
+private:
+	void SendSnapshot(const std::vector<PollingSocket*>& sockets);
+	void Send(const MessageWriter& writer, const std::vector<PollingSocket*>& sockets);
+	void Remove(PollingSocket* socket, int slot);
+	bool HasWork() const;
+
+private:
+	static unsigned int sDeltaInterval;
+	static std::vector<SpectatorChannel*> sDirty;
+
+	WriteFunc mWriteSnapshot;
+	WriteFunc mWriteDelta;
+	RoomStats* mStats;
+
+	std::vector<PollingSocket*> mSpectators;
+	std::vector<PollingSocket*> mJoining;
+
+	MessageWriter mSnapshot;
+	int mSnapshotVersion;
+	MessageWriter mDelta;
+
+	int mVersion;
+	int mDeltaFrom;
+	bool mDeltaPending;
+	bool mResetPending;
+	unsigned int mLastDelta;
+
+	bool mWatched;
+	bool mDirty;
+};
@@ -0,0 +1,162 @@
+#include "TaskPool.h"
+
+#include <cassert>
+#include <algorithm>
+
+#include "Log.h"
+
+
+TaskPool::TaskPool(void)
+	: mNextWorker(0)
+	, mStop(false)
+	, mQueued(0)
+	, mPending(0)
+{
+}
+
+
+TaskPool::~TaskPool(void)
+{
+	Shutdown();
+}
+
+
+void TaskPool::Init(int numThreads)
+{
+	assert(mThreads.empty());
+
+	if (numThreads <= 0)
+	{
+		numThreads = std::max<int>(static_cast<int>(std::thread::hardware_concurrency()) - 1, 1);
+	}
+
+	LOG("TaskPool::Init() - threads[%d]", numThreads);
+
+	mStop = false;
+
+	for (int i = 0 ; i < numThreads ; ++i)
+	{
+		mWorkers.push_back(new Worker);
+	}
+
+	for (int i = 0 ; i < numThreads ; ++i)
+	{
+		mThreads.push_back(std::thread(&TaskPool::Run, this, i));
+	}
+}
+
+
+void TaskPool::Shutdown()
+{
+	if (mThreads.empty())
+	{
+		return;
+	}
+
+	LOG("TaskPool::Shutdown()");
+
+	{
+		std::lock_guard<std::mutex> lock(mWakeLock);
+		mStop = true;
+	}
+	mWake.notify_all();
+
+	// the workers finish what is queued before they leave.
+	for (size_t i = 0 ; i < mThreads.size() ; ++i)
+	{
+		mThreads[i].join();
+	}
+	mThreads.clear();
+
+	for (size_t i = 0 ; i < mWorkers.size() ; ++i)
+	{
+		delete mWorkers[i];
+	}
+	mWorkers.clear();
+}
+
+
+void TaskPool::Submit(const Task& task)
+{
+	assert(!mWorkers.empty());
+
+	++mPending;
+
+	Worker* worker = mWorkers[mNextWorker];
+	mNextWorker = (mNextWorker + 1) % mWorkers.size();
+
+	{
+		std::lock_guard<std::mutex> lock(worker->lock);
+		worker->tasks.push_back(task);
+	}
+
+	++mQueued;
+}
+
+
+void TaskPool::Start()
+{
+	{
+		// pairs with the predicate check in Run() so a worker about to sleep does not miss it.
+		std::lock_guard<std::mutex> lock(mWakeLock);
+	}
+	mWake.notify_all();
+}
+
+
+void TaskPool::Run(int index)
+{
+	for (;;)
+	{
+		Task task;
+		if (Pop(index, task))
+		{
+			task();
+			--mPending;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(mWakeLock);
+		mWake.wait(lock, [this]() { return mStop || mQueued.load() > 0; });
+
+		if (mStop && mQueued.load() == 0)
+		{
+			return;
+		}
+	}
+}
+
+
+bool TaskPool::Pop(int index, Task& task)
+{
+	int numWorkers = static_cast<int>(mWorkers.size());
+
+	for (int i = 0 ; i < numWorkers ; ++i)
+	{
+		Worker* worker = mWorkers[(index + i) % numWorkers];
+
+		std::lock_guard<std::mutex> lock(worker->lock);
+		if (worker->tasks.empty())
+		{
+			continue;
+		}
+
+		if (i == 0)
+		{
+			// own work, newest first.
+			task.swap(worker->tasks.back());
+			worker->tasks.pop_back();
+		}
+		else
+		{
+			// stolen, oldest first.
+			task.swap(worker->tasks.front());
+			worker->tasks.pop_front();
+		}
+
+		--mQueued;
+		return true;
+	}
+
+	return false;
+}
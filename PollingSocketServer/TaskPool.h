@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <boost/function.hpp>
+
+#include "TSingleton.h"
+
+// Worker threads that run room ticks away from the I/O thread.
+// The I/O thread Submit()s a batch of tasks and Start()s it, then keeps polling sockets.
+// Each worker has its own deque. Submit() deals the tasks out round robin, a worker runs
+// its own from the back and steals from the front of the others when it runs dry.
+// IsIdle() tells the I/O thread when the whole batch is done.
+class TaskPool : public TSingleton<TaskPool>
+{
+public:
+	typedef boost::function<void ()> Task;
+
+public:
+	TaskPool(void);
+	virtual ~TaskPool(void);
+
+	// numThreads 0 : one per core, leaving one for the I/O thread.
+	void Init(int numThreads);
+	void Shutdown();
+
+	void Submit(const Task& task);
+	void Start();
+
+	bool IsIdle() const { return mPending.load() == 0; }
+	int GetNumThreads() const { return static_cast<int>(mThreads.size()); }
+
+private:
+	struct Worker
+	{
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	void Run(int index);
+	bool Pop(int index, Task& task);
+
+private:
+	std::vector<Worker*> mWorkers;
+	std::vector<std::thread> mThreads;
+	int mNextWorker;
+
+	std::mutex mWakeLock;
+	std::condition_variable mWake;
+	bool mStop;
+
+	std::atomic<int> mQueued;	// not picked up yet.
+	std::atomic<int> mPending;	// not finished yet.
+};
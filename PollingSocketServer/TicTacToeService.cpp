@@ -3,13 +3,16 @@
 #include <algorithm>
 
 #include "Server.h"
+#include "Message.h"
 #include "Log.h"
 
-#include <rapidjson/writer.h>
-#include <rapidjson/stringbuffer.h>
 #include <boost/bind.hpp>
 
-/*static*/ TicTacToeService::ServiceList TicTacToeService::sServices;
+/*static*/ Matchmaking::OpenSeats<TicTacToeService> TicTacToeService::sOpenSeats;
+/*static*/ Matchmaking::JoinCodes<TicTacToeService> TicTacToeService::sJoinCodes;
+/*static*/ Matchmaking::RoomListing TicTacToeService::sListing(TicTacToeService::GetMessageType());
+/*static*/ TicTacToeService::ServicePool TicTacToeService::sServices;
+/*static*/ RoomChecks<TicTacToeService> TicTacToeService::sChecks(&TicTacToeService::CheckRoom);
 
 /*static*/ void TicTacToeService::Init()
 {
@@ -20,94 +23,124 @@
 {
 	LOG("TicTacToeService::Shutdown()");
 
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
-	{
-		delete sServices[i];
-	}
-	sServices.clear();
+	sServices.Clear();
+	sJoinCodes.Clear();
 }
 
 
-/*static*/ void TicTacToeService::Update()
+/*static*/ void TicTacToeService::OnRecv(PollingSocket* client, Message& message)
 {
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
-	{
-		sServices[i]->UpdateInternal();
-	}
-
-	Flush();
-}
+	sChecks.Enter();
 
-/*static*/ void TicTacToeService::OnRecv(PollingSocket* client, rapidjson::Document& data)
-{
-	if (CreateOrEnter(client, data))
+	if (!CreateOrEnter(client, message))
 	{
-		return;
+		Session& session = client->GetSession();
+		if (session.IsBoundTo(Session::kServiceTicTacToe))
+		{
+			TicTacToeService* service = static_cast<TicTacToeService*>(session.room);
+			service->OnRecvInternal(client, message);
+			sChecks.Push(service);
+		}
 	}
 
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
-	{
-		sServices[i]->OnRecvInternal(client, data);
-	}
+	sChecks.Leave();
 }
 
 /*static*/ void TicTacToeService::RemoveClient(PollingSocket* client)
 {
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
+	Session& session = client->GetSession();
+	if (session.IsBoundTo(Session::kServiceTicTacToe))
 	{
-		if (!sServices[i]->RemoveClientInternal(client))
-		{
-			return;
-		}
+		// also called from inside a handler of the room, when a send to the client fails.
+		TicTacToeService* service = static_cast<TicTacToeService*>(session.room);
+		service->RemoveClientInternal(client);
+		sChecks.Push(service);
+		sChecks.Flush();
 	}
 }
 
-/*static*/ bool TicTacToeService::CreateOrEnter(PollingSocket* client, rapidjson::Document& data)
+/*static*/ bool TicTacToeService::CreateOrEnter(PollingSocket* client, Message& message)
 {
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "service_create")
+	if (message.IsType("service_create"))
 	{
-		assert(data["name"].IsString());
-		std::string name(data["name"].GetString());
+		std::string name;
+		message.GetString("name", name);
 
 		if (name == "tictactoe")
 		{
-			for (size_t i = 0 ; i < sServices.size() ; ++i)
+			Matchmaking::JoinRequest request = Matchmaking::ReadJoinRequest(message);
+
+			TicTacToeService* service = NULL;
+			if (!Matchmaking::Resolve(request, sOpenSeats, sJoinCodes, sServices, service))
 			{
-				TicTacToeService* service = sServices[i];
+				MessageWriter writer;
+				Matchmaking::WriteJoinFailed(writer, GetMessageType(), request);
+				client->AsyncSend(writer.GetData(), writer.GetSize());
+				return true;
+			}
+
+			if (service != NULL && client->GetSession().room == service)
+			{
+				// already playing there.
+				return true;
+			}
+
+			// a connection plays in one room at a time. the one it is in is left only now that there is another.
+			Server::Instance()->LeaveRoom(client);
 
-				if (service->mFSM.GetState() == kStateWait && service->m_Clients.size() < 2)
+			if (service == NULL)
+			{
+				service = sServices.Acquire();
+				service->mStats.Reset();
+				service->mBucket = request.bucket;
+				if (request.kind == Matchmaking::JoinRequest::kJoinNewPrivate)
 				{
-					service->AddClient(client);
-					return true;
+					sJoinCodes.Assign(*service);
 				}
+				service->OpenSeat();
 			}
 
-			TicTacToeService* newService = new TicTacToeService;
-			newService->AddClient(client);
-			sServices.push_back(newService);
+			service->AddClient(client);
+
+			if (Matchmaking::WriteJoined(service->mWriter, GetMessageType(), *service))
+			{
+				service->Send(client, service->mWriter);
+			}
 			return true;
 		}
 	}
 	return false;
 }
 
-/*static*/ void TicTacToeService::Flush()
+/*static*/ void TicTacToeService::ListRooms(PollingSocket* client, Message& message)
 {
-	for (auto itor = sServices.begin() ; itor != sServices.end() ; )
+	if (sListing.IsStale())
 	{
-		TicTacToeService* service = *itor;
+		sListing.Rebuild(sServices.GetActive());
+	}
 
-		if (service->mFSM.GetState() == kStateWait && service->m_Clients.empty())
-		{
-			delete service;
-			itor = sServices.erase(itor);
-		}
-		else
-		{
-			++itor;
-		}
+	int page = 0;
+	message.GetInt("page", page);
+
+	const MessageWriter& writer = sListing.GetPage(page);
+	client->AsyncSend(writer.GetData(), writer.GetSize());
+}
+
+/*static*/ void TicTacToeService::CollectStats(RoomStatsReport::EntryList& entries)
+{
+	RoomStatsReport::Collect(GetMessageType(), sServices, entries);
+}
+
+/*static*/ void TicTacToeService::CheckRoom(TicTacToeService* service)
+{
+	// nothing in a room moves on time, so it is checked once each event is handled instead of every loop.
+	service->CheckPlayerConnection();
+
+	if (service->mFSM.GetState() == kStateWait && service->m_Clients.empty())
+	{
+		sOpenSeats.Close(*service);
+		sJoinCodes.Reclaim(*service);
+		sServices.Release(service);
 	}
 }
 
@@ -147,23 +180,18 @@ void TicTacToeService::ShutdownFSM()
 }
 
 
-void TicTacToeService::UpdateInternal()
+void TicTacToeService::OnRecvInternal(PollingSocket* client, Message& message)
 {
-	CheckPlayerConnection();
-
-	mFSM.Update();
-}
+	RoomStats::Scope scope(mStats);
+	++mStats.messagesIn;
 
-
-void TicTacToeService::OnRecvInternal(PollingSocket* client, rapidjson::Document& data)
-{
 	switch(mFSM.GetState())
 	{
-	case kStateWait:			OnUpdateWait(client, data);			break;
-	case kStatePlayer1Turn:		OnUpdatePlayer1Turn(client, data);	break;
-	case kStatePlayer2Turn:		OnUpdatePlayer2Turn(client, data);	break;
-	case kStateCheckResult:		OnUpdateCheckResult(client, data);	break;
-	case kStateGameCanceled:	OnUpdateGameCanceled(client, data);	break;
+	case kStateWait:			OnUpdateWait(client, message);			break;
+	case kStatePlayer1Turn:		OnUpdatePlayer1Turn(client, message);	break;
+	case kStatePlayer2Turn:		OnUpdatePlayer2Turn(client, message);	break;
+	case kStateCheckResult:		OnUpdateCheckResult(client, message);	break;
+	case kStateGameCanceled:	OnUpdateGameCanceled(client, message);	break;
 
 	default:
 		assert(0);
@@ -178,6 +206,12 @@ void TicTacToeService::AddClient(PollingSocket* client)
 	assert(m_Clients.size() < 2);
 
 	m_Clients.push_back(client);
+	client->GetSession().Bind(Session::kServiceTicTacToe, this, static_cast<int>(m_Clients.size()) - 1);
+
+	if (m_Clients.size() == 2)
+	{
+		sOpenSeats.Close(*this);
+	}
 
 	if (m_Clients.size() == 1)
 	{
@@ -198,12 +232,55 @@ bool TicTacToeService::RemoveClientInternal(PollingSocket* client)
 	if (itor != m_Clients.end())
 	{
 		m_Clients.erase(itor);
+		client->GetSession().Clear();
+
+		if (mFSM.GetState() == kStateWait)
+		{
+			OpenSeat();
+		}
 		return true;
 	}
 	return false;
 }
 
 
+void TicTacToeService::ClearClients()
+{
+	for (size_t i = 0 ; i < m_Clients.size() ; ++i)
+	{
+		m_Clients[i]->GetSession().Clear();
+	}
+	m_Clients.clear();
+}
+
+
+void TicTacToeService::OpenSeat()
+{
+	// rooms waiting in the pool are not matched, private ones only by their code.
+	if (IsPoolActive() && !IsPrivate())
+	{
+		sOpenSeats.Open(*this, mBucket);
+	}
+}
+
+
+bool TicTacToeService::HasOpenSeat()
+{
+	return mFSM.GetState() == kStateWait && static_cast<int>(m_Clients.size()) < 2;
+}
+
+
+void TicTacToeService::WriteListEntry(MessageWriter& writer)
+{
+	writer.StartObject();
+	writer.Int("room", GetRoomId());
+	writer.Int("players", static_cast<int>(m_Clients.size()));
+	writer.Int("max_players", 2);
+	writer.String("bucket", mBucket.c_str());
+	writer.EndObject();
+}
+
+
 void TicTacToeService::CheckPlayerConnection()
 {
 	if (mFSM.GetState() == kStateWait)
@@ -225,28 +302,26 @@ void TicTacToeService::CheckPlayerConnection()
 }
 
 
-void TicTacToeService::Send(PollingSocket* client, rapidjson::Document& data)
+void TicTacToeService::Send(PollingSocket* client, const MessageWriter& writer)
 {
-	client->AsyncSend(data);
+	client->AsyncSend(writer.GetData(), writer.GetSize());
+	mStats.OnSend(writer.GetSize());
 }
 
 
-void TicTacToeService::Broadcast(rapidjson::Document& data)
+void TicTacToeService::Broadcast(const MessageWriter& writer)
 {
 	for (size_t i = 0 ; i < m_Clients.size() ; ++i)
 	{
-		Send(m_Clients[i], data);
+		Send(m_Clients[i], writer);
 	}
 }
 
-void TicTacToeService::SetPlayerName(Player& player, rapidjson::Document& data)
+void TicTacToeService::SetPlayerName(Player& player, Message& message)
 {
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "tictactoe")
+	if (message.IsType("tictactoe"))
 	{
-		assert(data["name"].IsString());
-		player.name = data["name"].GetString();
+		message.GetString("name", player.name);
 	}
 }
 
@@ -271,17 +346,19 @@ void TicTacToeService::OnEnterWait(int nPrevState)
 
 	mLastMoveRow = 0;
 	mLastMoveCol = 0;
+
+	OpenSeat();
 }
 
-void TicTacToeService::OnUpdateWait(PollingSocket* client, rapidjson::Document& data)
+void TicTacToeService::OnUpdateWait(PollingSocket* client, Message& message)
 {
 	if (mPlayer1.client == client)
 	{
-		SetPlayerName(mPlayer1, data);
+		SetPlayerName(mPlayer1, message);
 	}
 	else if (mPlayer2.client == client)
 	{
-		SetPlayerName(mPlayer2, data);
+		SetPlayerName(mPlayer2, message);
 	}
 	else
 	{
@@ -290,18 +367,17 @@ void TicTacToeService::OnUpdateWait(PollingSocket* client, rapidjson::Document&
 
 	if (!mPlayer1.name.empty() && !mPlayer2.name.empty())
 	{
-		rapidjson::Document playerData;
-		playerData.SetObject();
-		playerData.AddMember("type", "tictactoe", playerData.GetAllocator());
-		playerData.AddMember("subtype", "setplayers", playerData.GetAllocator());
-		playerData.AddMember("player1_name", mPlayer1.name.c_str(), playerData.GetAllocator());
-		playerData.AddMember("player2_name", mPlayer2.name.c_str(), playerData.GetAllocator());
-
-		playerData.AddMember("assigned_to", 1, playerData.GetAllocator());
-		Send(mPlayer1.client, playerData);
+		const Player* players[] = { &mPlayer1, &mPlayer2 };
+		for (int i = 0 ; i < 2 ; ++i)
+		{
+			mWriter.Begin("tictactoe", "setplayers");
+			mWriter.String("player1_name", mPlayer1.name.c_str());
+			mWriter.String("player2_name", mPlayer2.name.c_str());
+			mWriter.Int("assigned_to", i + 1);
+			mWriter.End();
 
-		playerData["assigned_to"] = 2;
-		Send(mPlayer2.client, playerData);
+			Send(players[i]->client, mWriter);
+		}
 
 		mFSM.SetState(kStatePlayer1Turn);
 	}
@@ -310,30 +386,30 @@ void TicTacToeService::OnUpdateWait(PollingSocket* client, rapidjson::Document&
 void TicTacToeService::OnLeaveWait(int nNextState)
 {
 	LOG("TicTacToeService::OnLeaveWait()");
+
+	sOpenSeats.Close(*this);
 }
 
 
 void TicTacToeService::SetPlayerTurn(int playerTurn)
 {
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "tictactoe", data.GetAllocator());
-	data.AddMember("subtype", "setturn", data.GetAllocator());
-	data.AddMember("player", playerTurn, data.GetAllocator());
-	Broadcast(data);
+	mWriter.Begin("tictactoe", "setturn");
+	mWriter.Int("player", playerTurn);
+	mWriter.End();
+	Broadcast(mWriter);
 }
 
-void TicTacToeService::CheckPlayerMove(Player& player, Symbol symbol, rapidjson::Document& data)
+void TicTacToeService::CheckPlayerMove(Player& player, Symbol symbol, Message& message)
 {
-	assert(data["type"].IsString());
-	std::string type(data["type"].GetString());
-	if (type == "tictactoe")
+	if (message.IsType("tictactoe"))
 	{
-		assert(data["row"].IsInt());
-		int row = data["row"].GetInt();
-
-		assert(data["col"].IsInt());
-		int col = data["col"].GetInt();
+		int row = 0;
+		int col = 0;
+		if (!message.GetInt("row", row) || !message.GetInt("col", col))
+		{
+			LOG("TicTacToeService::CheckPlayerMove() - row / col is missing. ignored.");
+			return;
+		}
 
 		if (row >=0 && row < kCellRows && col >= 0 && col < kCellColumns)
 		{
@@ -345,14 +421,12 @@ void TicTacToeService::CheckPlayerMove(Player& player, Symbol symbol, rapidjson:
 				mLastMoveRow = row;
 				mLastMoveCol = col;
 
-				rapidjson::Document data;
-				data.SetObject();
-				data.AddMember("type", "tictactoe", data.GetAllocator());
-				data.AddMember("subtype", "move", data.GetAllocator());
-				data.AddMember("player", symbol == kSymbolOOO ? 1 : 2, data.GetAllocator());
-				data.AddMember("row", row, data.GetAllocator());
-				data.AddMember("col", col, data.GetAllocator());
-				Broadcast(data);
+				mWriter.Begin("tictactoe", "move");
+				mWriter.Int("player", symbol == kSymbolOOO ? 1 : 2);
+				mWriter.Int("row", row);
+				mWriter.Int("col", col);
+				mWriter.End();
+				Broadcast(mWriter);
 
 				mFSM.SetState(kStateCheckResult);
 			}
@@ -375,11 +449,11 @@ void TicTacToeService::OnEnterPlayer1Turn(int nPrevState)
 	SetPlayerTurn(1);
 }
 
-void TicTacToeService::OnUpdatePlayer1Turn(PollingSocket* client, rapidjson::Document& data)
+void TicTacToeService::OnUpdatePlayer1Turn(PollingSocket* client, Message& message)
 {
 	if (mPlayer1.client == client)
 	{
-		CheckPlayerMove(mPlayer1, kSymbolOOO, data);
+		CheckPlayerMove(mPlayer1, kSymbolOOO, message);
 	}
 	else
 	{
@@ -399,11 +473,11 @@ void TicTacToeService::OnEnterPlayer2Turn(int nPrevState)
 	SetPlayerTurn(2);
 }
 
-void TicTacToeService::OnUpdatePlayer2Turn(PollingSocket* client, rapidjson::Document& data)
+void TicTacToeService::OnUpdatePlayer2Turn(PollingSocket* client, Message& message)
 {
 	if (mPlayer2.client == client)
 	{
-		CheckPlayerMove(mPlayer2, kSymbolXXX, data);
+		CheckPlayerMove(mPlayer2, kSymbolXXX, message);
 	}
 	else
 	{
@@ -418,25 +492,23 @@ void TicTacToeService::OnLeavePlayer2Turn(int nNextState)
 
 void TicTacToeService::SetGameEnd(Symbol winning)
 {
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "tictactoe", data.GetAllocator());
-	data.AddMember("subtype", "result", data.GetAllocator());
+	mWriter.Begin("tictactoe", "result");
 
 	switch(winning)
 	{
-	case kSymbolNone:	data.AddMember("winner", -1, data.GetAllocator());	break;
-	case kSymbolOOO:	data.AddMember("winner", 1, data.GetAllocator());	break;
-	case kSymbolXXX:	data.AddMember("winner", 2, data.GetAllocator());	break;
+	case kSymbolNone:	mWriter.Int("winner", -1);	break;
+	case kSymbolOOO:	mWriter.Int("winner", 1);	break;
+	case kSymbolXXX:	mWriter.Int("winner", 2);	break;
 
 	default:
 		assert(0);
 		return;
 	}
 
-	Broadcast(data);
+	mWriter.End();
+	Broadcast(mWriter);
 
-	m_Clients.clear();
+	ClearClients();
 
 	mFSM.SetState(kStateWait);
 }
@@ -566,7 +638,7 @@ void TicTacToeService::OnEnterCheckResult(int nPrevState)
 	mFSM.SetState(lastSymbol == kSymbolOOO ? kStatePlayer2Turn : kStatePlayer1Turn);
 }
 
-void TicTacToeService::OnUpdateCheckResult(PollingSocket* client, rapidjson::Document& data) 
+void TicTacToeService::OnUpdateCheckResult(PollingSocket* client, Message& message) 
 {
 }
 
@@ -580,19 +652,17 @@ void TicTacToeService::OnEnterGameCanceled(int nPrevState)
 {
 	LOG("TicTacToeService::OnEnterGameCanceled()");
 
-	rapidjson::Document data;
-	data.SetObject();
-	data.AddMember("type", "tictactoe", data.GetAllocator());
-	data.AddMember("subtype", "canceled", data.GetAllocator());
-	Broadcast(data);
+	mWriter.Begin("tictactoe", "canceled");
+	mWriter.End();
+	Broadcast(mWriter);
 
-	m_Clients.clear();
+	ClearClients();
 
 	mFSM.SetState(kStateWait);
 }
 
 
-void TicTacToeService::OnUpdateGameCanceled(PollingSocket* client, rapidjson::Document& data)
+void TicTacToeService::OnUpdateGameCanceled(PollingSocket* client, Message& message)
 {
 }
 
@@ -1,31 +1,59 @@
 #pragma once
 
 #include <vector>
-#include <rapidjson/document.h>
+#include <string>
 
 #include "FSM.h"
+#include "MessageWriter.h"
+#include "Session.h"
+#include "Matchmaking.h"
+#include "RoomPool.h"
+#include "RoomChecks.h"
+#include "RoomStats.h"
 
 
 class PollingSocket;
+class Message;
 
-class TicTacToeService
+class TicTacToeService : public Matchmaking::OpenSeatHook, public Matchmaking::JoinCodeHook, public RoomPoolHook
 {
+public:
+	// ServicePack traits.
+	enum
+	{
+		kTicked = false,
+		kCreatesRooms = true,
+		kSession = Session::kServiceTicTacToe,
+		kSpectated = false,
+	};
+	static const char* GetMessageType() { return "tictactoe"; }
+
 public:
 	static void Init();
 	static void Shutdown();
 
-	static void Update();
-	static void OnRecv(PollingSocket* client, rapidjson::Document& data);
+	static void OnRecv(PollingSocket* client, Message& message);
 
 	static void RemoveClient(PollingSocket* client);
+	static void ListRooms(PollingSocket* client, Message& message);
+	static void CollectStats(RoomStatsReport::EntryList& entries);
+	const RoomStats& GetStats() const { return mStats; }
 
 private:
-	static bool CreateOrEnter(PollingSocket* client, rapidjson::Document& data);
-	static void Flush();
+	static bool CreateOrEnter(PollingSocket* client, Message& message);
+	static void CheckRoom(TicTacToeService* service);
 
 private:
-	typedef std::vector<TicTacToeService*> ServiceList;
-	static ServiceList sServices;
+	friend class RoomPool<TicTacToeService>;
+	friend class Matchmaking::RoomListing;
+	friend struct Matchmaking::JoinResolver<TicTacToeService>;
+
+	typedef RoomPool<TicTacToeService> ServicePool;
+	static Matchmaking::OpenSeats<TicTacToeService> sOpenSeats;
+	static Matchmaking::JoinCodes<TicTacToeService> sJoinCodes;
+	static Matchmaking::RoomListing sListing;
+	static ServicePool sServices;
+	static RoomChecks<TicTacToeService> sChecks;
 
 private:
 	enum State
@@ -62,42 +90,47 @@ private:
 	TicTacToeService(void);
 	~TicTacToeService(void);
 
-	void UpdateInternal();
-	void OnRecvInternal(PollingSocket* client, rapidjson::Document& data);
+	void OnRecvInternal(PollingSocket* client, Message& message);
 
 	void AddClient(PollingSocket* client);
 	bool RemoveClientInternal(PollingSocket* client);
+	void ClearClients();
 
 	void InitFSM();
 	void ShutdownFSM();
 
 	void OnEnterWait(int nPrevState);
-	void OnUpdateWait(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdateWait(PollingSocket* client, Message& message);
 	void OnLeaveWait(int nNextState);
 
 	void OnEnterPlayer1Turn(int nPrevState);
-	void OnUpdatePlayer1Turn(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdatePlayer1Turn(PollingSocket* client, Message& message);
 	void OnLeavePlayer1Turn(int nNextState);
 
 	void OnEnterPlayer2Turn(int nPrevState);
-	void OnUpdatePlayer2Turn(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdatePlayer2Turn(PollingSocket* client, Message& message);
 	void OnLeavePlayer2Turn(int nNextState);
 
 	void OnEnterCheckResult(int nPrevState);
-	void OnUpdateCheckResult(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdateCheckResult(PollingSocket* client, Message& message);
 	void OnLeaveCheckResult(int nNextState);
 
 	void OnEnterGameCanceled(int nPrevState);
-	void OnUpdateGameCanceled(PollingSocket* client, rapidjson::Document& data);
+	void OnUpdateGameCanceled(PollingSocket* client, Message& message);
 	void OnLeaveGameCanceled(int nNextState);
 
 	void DummyUpdate(double) {}
 
+	void OpenSeat();
+	bool HasOpenSeat();
+
+	bool IsListed() { return !IsPrivate() && HasOpenSeat(); }
+	void WriteListEntry(MessageWriter& writer);
 	void CheckPlayerConnection();
 
-	void SetPlayerName(Player& player, rapidjson::Document& data);
+	void SetPlayerName(Player& player, Message& message);
 	void SetPlayerTurn(int playerTurn);
-	void CheckPlayerMove(Player& player, Symbol symbol, rapidjson::Document& data);
+	void CheckPlayerMove(Player& player, Symbol symbol, Message& message);
 	void SetGameEnd(Symbol winning);
 
 	bool CheckRowStraight(int col, Symbol symbol);
@@ -106,8 +139,8 @@ private:
 	bool CheckBackSlashStraight(Symbol symbol);
 	bool CheckBoardIsFull();
 
-	void Send(PollingSocket* client, rapidjson::Document& data);
-	void Broadcast(rapidjson::Document& data);
+	void Send(PollingSocket* client, const MessageWriter& writer);
+	void Broadcast(const MessageWriter& writer);
 
 private:
 	typedef std::vector<PollingSocket*> ClientList;
@@ -121,4 +154,11 @@ private:
 
 	int mLastMoveRow;
 	int mLastMoveCol;
+
+	MessageWriter mWriter;
+
+	// the matchmaking bucket the room was opened for.
+	std::string mBucket;
+
+	RoomStats mStats;
 };
@@ -1,25 +1,84 @@
 #include <string>
+#include <cstring>
 #include <iostream>
+#include <algorithm>
 using namespace std;
 
 #include "Log.h"
 #include "Network.h"
 #include "Server.h"
+#include "Message.h"
+#include "Benchmark.h"
+#include "SnakeCyclesService.h"
+
+namespace
+{
+	const int kMaxReplayFiles = 1000;	// a run records no more games than this.
+}
 
 void main(int argc, char* argv[])
 {
 	Log::Init();
 
-	if (argc != 2)
+	if (argc >= 2 && strcmp(argv[1], "benchparser") == 0)
+	{
+		Benchmark::RunParser(argc > 2 ? argv[2] : NULL);
+		Log::Shutdown();
+		return;
+	}
+
+	if (argc >= 3 && strcmp(argv[1], "replay") == 0)
+	{
+		SnakeCyclesService::RunReplay(argv[2], argc > 3 ? std::max(atoi(argv[3]), 1) : 1);
+		Log::Shutdown();
+		return;
+	}
+
+	if (argc >= 2 && strcmp(argv[1], "benchbots") == 0)
 	{
-		LOG("Please add port number");
+		Benchmark::RunSnakeBots();
+		Log::Shutdown();
+		return;
+	}
+
+	if (argc < 2)
+	{
+		LOG("Please add port number and optionally the parser (dom, ondemand, incremental), batch and record <directory>");
 		LOG("(ex) 17000");
+		LOG("(ex) 17000 ondemand");
+		LOG("(ex) 17000 ondemand batch");
+		LOG("(ex) 17000 record replays");
+		LOG("Or benchmark the parsers with captured frames");
+		LOG("(ex) benchparser frames.txt");
+		LOG("Or benchmark the SnakeCycles bots");
+		LOG("(ex) benchbots");
+		LOG("Or play a recorded SnakeCycles game again, a number of times");
+		LOG("(ex) replay snakecycles_3_0.rpl 100");
 		return;
 	}
 
 	u_short port = static_cast<u_short>( atoi(argv[1]) );
 
-	LOG("Input : port : %d", port);
+	for (int i = 2 ; i < argc ; ++i)
+	{
+		// the SnakeCycles players move in one pass over all the rooms.
+		if (strcmp(argv[i], "batch") == 0)
+		{
+			SnakeCyclesService::SetBatchMovement(true);
+		}
+		else if (strcmp(argv[i], "record") == 0 && i + 1 < argc)
+		{
+			// the SnakeCycles games are written to replay files, up to a cap.
+			SnakeCyclesService::SetRecordReplays(argv[++i], kMaxReplayFiles);
+		}
+		else if (!Message::SetParser(argv[i]))
+		{
+			ERROR_MSG("Unknown parser : %s", argv[i]);
+			return;
+		}
+	}
+
+	LOG("Input : port : %d, parser : %s", port, Message::GetParserName(Message::GetParser()));
 
 	if(Network::Init() == false)
 	{